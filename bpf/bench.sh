@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# capture throughput of a tool against pktgen on a local veth pair:
+# generated vs delivered packets, drop rate and CPU of the capture tool
+# usage: ./bench.sh [tool] [pps] [seconds] [size,...] [proto,...]
+
+set -e
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+TOOL=${1:-ipdump}
+RATE=${2:-100000}
+SECS=${3:-5}
+SIZE=${4:-64,512,1500}
+PROTO=${5:-udp4,tcp4}
+DEV=bench0
+PEER=bench1
+DIR=$(mktemp -d)
+
+if ! ip link show $DEV > /dev/null 2>&1; then
+    ip link add $DEV type veth peer name $PEER
+    # no router solicitations or MLD reports mixed into the count
+    sysctl -qw net.ipv6.conf.$DEV.disable_ipv6=1
+    sysctl -qw net.ipv6.conf.$PEER.disable_ipv6=1
+    ip link set $DEV up
+    ip link set $PEER up
+fi
+
+cd $DIR
+IFACE=$DEV $BIN/$TOOL > tool.txt 2>&1 &
+PID=$!
+START=$(date +%s.%N)
+sleep 1
+
+$BIN/pktgen -i $DEV -r $RATE -t $SECS -s $SIZE -p $PROTO > gen.txt
+sleep 1
+
+CPU=$(awk '{ print $14 + $15 }' /proc/$PID/stat)
+END=$(date +%s.%N)
+kill -INT $PID
+wait $PID || true
+
+GEN=$(awk '/^sent/ { print $2 }' gen.txt)
+GOT=$(awk '/^packets/ { print $2 }' tool.txt)
+awk -v tool=$TOOL -v g=$GEN -v d=${GOT:-0} -v c=$CPU -v hz=$(getconf CLK_TCK) \
+    -v t=$(echo "$END $START" | awk '{ print $1 - $2 }') 'BEGIN {
+    printf "%s generated %d delivered %d drop %.2f%% cpu %.1f%%\n",
+        tool, g, d, g ? 100 * (g - d) / g : 0, 100 * c / hz / t
+}'
+cat gen.txt
+cd - > /dev/null
+rm -rf $DIR
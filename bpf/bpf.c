@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
 #include <net/if.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <linux/if_packet.h>
+#include <linux/perf_event.h>
 
 #include "bpf.h"
 #include "../tools.h"
@@ -145,6 +153,39 @@ bpf_map_pop(__u32 map_fd, void *value) {
     return 0;
 }
 
+int
+bpf_map_update(__u32 map_fd, void *key, void *value, __u64 flags) {
+    union bpf_attr attr = {0};
+    attr.map_fd = map_fd;
+    attr.key = ptr_to_u64(key);
+    attr.value = ptr_to_u64(value);
+    attr.flags = flags;
+    if (syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) == -1)
+        return errno;
+    return 0;
+}
+
+int
+bpf_map_delete(__u32 map_fd, void *key) {
+    union bpf_attr attr = {0};
+    attr.map_fd = map_fd;
+    attr.key = ptr_to_u64(key);
+    if (syscall(__NR_bpf, BPF_MAP_DELETE_ELEM, &attr, sizeof(attr)) == -1)
+        return errno;
+    return 0;
+}
+
+int
+bpf_map_next(__u32 map_fd, void *key, void *next) {
+    union bpf_attr attr = {0};
+    attr.map_fd = map_fd;
+    attr.key = ptr_to_u64(key);
+    attr.next_key = ptr_to_u64(next);
+    if (syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr)) == -1)
+        return errno;
+    return 0;
+}
+
 int
 bpf_prog_load(int *prog, __u32 prog_type, struct bpf_insn *insns,
     __u32 insn_cnt, char *license, uint32_t dump) {
@@ -200,6 +241,56 @@ err:
     return ret;
 }
 
+// if_attach, then join fanout group on the interface. mode is
+// PACKET_FANOUT_HASH, _CPU, ... or _EBPF with prog returning the socket
+int
+if_attach_fanout(int *sock, char *name, int bpf, uint16_t group,
+    uint16_t mode, int prog) {
+    int ret = 0, arg = group | mode << 16;
+
+    TRY(!(ret = if_attach(sock, name, bpf)), return ret);
+    TRY(!setsockopt(*sock, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)),
+        RETURN(errno, err));
+    if (mode == PACKET_FANOUT_EBPF)
+        TRY(!setsockopt(*sock, SOL_PACKET, PACKET_FANOUT_DATA, &prog,
+            sizeof(prog)), RETURN(errno, err));
+err:
+    if (ret) {
+        close(*sock);
+        *sock = -1;
+    }
+    return ret;
+}
+
+int
+uprobe_attach(int *fd, char *path, uint64_t offset, int retprobe, int bpf) {
+    struct perf_event_attr attr = {0};
+    FILE *f = NULL;
+    int type, ret = 0;
+
+    *fd = -1;
+    TRY(f = fopen("/sys/bus/event_source/devices/uprobe/type", "r"),
+        RETURN(errno, err));
+    TRY(fscanf(f, "%d", &type) == 1, RETURN(EINVAL, err));
+
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = retprobe ? 1 : 0; // format/retprobe: config:0
+    attr.config1 = ptr_to_u64(path);
+    attr.config2 = offset;
+    TRY((*fd = syscall(__NR_perf_event_open, &attr, -1, 0, -1,
+        PERF_FLAG_FD_CLOEXEC)) != -1, RETURN(errno, err));
+    TRY(!ioctl(*fd, PERF_EVENT_IOC_SET_BPF, bpf), RETURN(errno, err));
+    TRY(!ioctl(*fd, PERF_EVENT_IOC_ENABLE, 0), RETURN(errno, err));
+err:
+    if (f) fclose(f);
+    if (ret && *fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+    return ret;
+}
+
 void
 eth_ip_addr(char *s, char *d, struct ethhdr *h) {
     uint16_t t = ntohs(h->h_proto);
@@ -211,8 +302,10 @@ eth_ip_addr(char *s, char *d, struct ethhdr *h) {
         inet_ntop(AF_INET, &((struct iphdr*)ip)->daddr, d, INET_ADDRSTRLEN);
         break;
     case ETH_P_IPV6:
-        inet_ntop(AF_INET6, &((struct iphdr*)ip)->saddr, s, INET6_ADDRSTRLEN);
-        inet_ntop(AF_INET6, &((struct iphdr*)ip)->daddr, d, INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET6, &((struct ipv6hdr*)ip)->saddr, s,
+            INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET6, &((struct ipv6hdr*)ip)->daddr, d,
+            INET6_ADDRSTRLEN);
         break;
     default: s[0] = d[0] = 0;
     }
@@ -248,9 +341,16 @@ struct pcap_file_header {
     uint32_t thiszone, sigfigs, snaplen, linktype;
 };
 
-struct pcap_pkthdr {
-    uint32_t sec, usec, caplen, len;
-};
+// EINTR retries, EAGAIN waits for room instead of dropping the rest
+int
+_file_wait(int fd, int err) {
+    struct pollfd p = {.fd = fd, .events = POLLOUT};
+
+    if (err == EINTR)
+        return 0;
+    TRYF(err == EAGAIN, return err, "%s\n", strerror(err));
+    return poll(&p, 1, -1) == -1 && errno != EINTR ? errno : 0;
+}
 
 int
 file_write(int fd, void *p0, size_t size) {
@@ -260,8 +360,8 @@ file_write(int fd, void *p0, size_t size) {
 
     while (size > 0) {
         if ((n = write(fd, p, size)) == -1) {
-            TRYF(errno == EAGAIN, RETURN(errno, err), "%s\n", strerror(errno));
-            break;
+            TRY(!(ret = _file_wait(fd, errno)), goto err);
+            continue;
         }
         p += n;
         size -= n;
@@ -271,44 +371,503 @@ err:
     return ret;
 }
 
+// consumes iov: partially written entries are advanced in place
+int
+file_writev(int fd, struct iovec *iov, int n) {
+    int ret = 0;
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX)) == -1) {
+            TRY(!(ret = _file_wait(fd, errno)), goto err);
+            continue;
+        }
+        for (; n > 0 && (size_t)w >= iov->iov_len; n--, iov++)
+            w -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+err:
+    return ret;
+}
+
+void
+_pcap_file_header(struct pcap_file_header *h) {
+    ZERO(*h);
+    // little-endian and microsecond
+    h->magic[0] = 0xd4;
+    h->magic[1] = 0xc3;
+    h->magic[2] = 0xb2;
+    h->magic[3] = 0xa1;
+    h->version_major = htole16(2);
+    h->version_minor = htole16(4);
+    h->snaplen = htole32(65535);
+    h->linktype = htole32(1); // ethernet
+}
+
 int
 pcap_open(int *fd, char *fn) {
     int ret = 0;
-    struct pcap_file_header h = {0};
+    struct pcap_file_header h;
 
     TRY((*fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644)) > 0,
         RETURN(errno, err));
-
-    // little-endian and microsecond
-    h.magic[0] = 0xd4;
-    h.magic[1] = 0xc3;
-    h.magic[2] = 0xb2;
-    h.magic[3] = 0xa1;
-    h.version_major = htole16(2);
-    h.version_minor = htole16(4);
-    h.snaplen = htole32(65535);
-    h.linktype = htole32(1); // ethernet
+    _pcap_file_header(&h);
     TRY(!(ret = file_write(*fd, &h, sizeof(h))),);
 err:
     return ret;
 }
 
+void
+pcap_rec(struct pcap_pkthdr *h, uint32_t size, struct timeval *t) {
+    h->sec = htole32(t->tv_sec);
+    h->usec = htole32(t->tv_usec);
+    h->len = h->caplen = htole32(size);
+}
+
 int
-pcap_write(int fd, void *p, uint32_t size) {
+pcap_write(int fd, void *p, uint32_t size, struct timeval *t) {
     int ret = 0;
-    struct pcap_pkthdr h = {0};
-    struct timeval t;
+    struct pcap_pkthdr h;
+    struct timeval now;
 
-    TRY(!gettimeofday(&t, NULL), RETURN(errno, err));
-    h.sec = htole32(t.tv_sec);
-    h.usec = htole32(t.tv_usec);
-    h.len = h.caplen = htole32(size);
+    // NULL stamps the record with the current time
+    if (!t) {
+        TRY(!gettimeofday(&now, NULL), RETURN(errno, err));
+        t = &now;
+    }
+    pcap_rec(&h, size, t);
     TRY(!(ret = file_write(fd, &h, sizeof(h))), goto err);
     TRY(!(ret = file_write(fd, p, size)),);
 err:
     return ret;
 }
 
+// FNV-1a of the flow with its endpoints in a fixed order
+uint64_t
+_pcap_flow_hash(struct pcap_flow *f) {
+    struct pcap_flow c = {0};
+    uint64_t h = 0xcbf29ce484222325UL;
+    uint8_t *p = (uint8_t*)&c;
+    size_t i;
+
+    c.proto = f->proto;
+    if (f->saddr < f->daddr ||
+        (f->saddr == f->daddr && f->sport <= f->dport)) {
+        c.saddr = f->saddr, c.sport = f->sport;
+        c.daddr = f->daddr, c.dport = f->dport;
+    } else {
+        c.saddr = f->daddr, c.sport = f->dport;
+        c.daddr = f->saddr, c.dport = f->sport;
+    }
+    for (i = 0; i < sizeof(c); i++)
+        h = (h ^ p[i]) * 0x100000001b3UL;
+    return h;
+}
+
+// 3 probes by double hashing
+#define _pcap_bloom_bit(h, i) \
+    (((uint32_t)(h) + (i) * (uint32_t)((h) >> 32)) % PCAP_BLOOM_BITS)
+
+void
+pcap_bloom_add(uint64_t *bloom, struct pcap_flow *f) {
+    uint64_t h = _pcap_flow_hash(f), b;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        b = _pcap_bloom_bit(h, i);
+        bloom[b / 64] |= 1UL << (b % 64);
+    }
+}
+
+int
+pcap_bloom_has(uint64_t *bloom, struct pcap_flow *f) {
+    uint64_t h = _pcap_flow_hash(f), b;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        b = _pcap_bloom_bit(h, i);
+        if (!(bloom[b / 64] & (1UL << (b % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+int
+pcap_index_open(struct pcap_index *x, char *fn) {
+    struct pcap_index_hdr h = {
+        .magic = PCAP_INDEX_MAGIC,
+        .bucket = PCAP_INDEX_BUCKET
+    };
+    char path[PATH_MAX];
+    int ret = 0;
+
+    ZERO(*x);
+    x->off = sizeof(struct pcap_file_header);
+    snprintf(path, sizeof(path), "%s.idx", fn);
+    TRY((x->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) > 0,
+        return errno);
+    TRY(!(ret = file_write(x->fd, &h, sizeof(h))),);
+    return ret;
+}
+
+int
+_pcap_index_flush(struct pcap_index *x) {
+    int ret = 0;
+
+    if (x->e.count)
+        TRY(!(ret = file_write(x->fd, &x->e, sizeof(x->e))),);
+    return ret;
+}
+
+// record of size bytes about to be written at x->off
+int
+pcap_index_add(struct pcap_index *x, struct timeval *t, struct pcap_flow *f,
+    uint32_t size) {
+    uint64_t usec = t->tv_sec * 1000000UL + t->tv_usec;
+    int ret = 0;
+
+    usec -= usec % PCAP_INDEX_BUCKET;
+    if (!x->e.count || x->e.usec != usec) {
+        TRY(!(ret = _pcap_index_flush(x)), return ret);
+        ZERO(x->e);
+        x->e.usec = usec;
+        x->e.off = x->off;
+    }
+    pcap_bloom_add(x->e.bloom, f);
+    x->e.count++;
+    x->off += sizeof(struct pcap_pkthdr) + size;
+    return 0;
+}
+
+int
+pcap_index_close(struct pcap_index *x) {
+    int ret;
+
+    ret = _pcap_index_flush(x);
+    close(x->fd);
+    x->fd = -1;
+    return ret;
+}
+
+int
+_sink_enter(struct pcap_sink *s, uint32_t submit, uint32_t wait) {
+    int n;
+
+    // resubmitting after EINTR is harmless, only queued sqes are consumed
+    while ((n = syscall(__NR_io_uring_enter, s->ring, submit, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1 && errno == EINTR);
+    return n == -1 ? errno : 0;
+}
+
+// completions recycle their segments
+int
+_sink_reap(struct pcap_sink *s) {
+    struct io_uring_cqe *c;
+    uint32_t head = *s->cq_head;
+    int ret = 0;
+
+    for (; head != __atomic_load_n(s->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        c = &((struct io_uring_cqe*)s->cqes)[head & *s->cq_mask];
+        if (c->res < 0)
+            ret = -c->res;
+        else if ((uint32_t)c->res != s->len[c->user_data])
+            ret = EIO;
+        s->busy &= ~(1U << c->user_data);
+    }
+    __atomic_store_n(s->cq_head, head, __ATOMIC_RELEASE);
+    TRYF(!ret,, "%s\n", strerror(ret));
+    return ret;
+}
+
+// writes bytes [from, to) of the current segment, id PCAP_SINK_NSEG marks
+// a flush of a segment still being filled. What an earlier flush already
+// wrote is skipped, down to the block it ended in
+int
+_sink_queue(struct pcap_sink *s, uint32_t to, uint32_t id) {
+    uint32_t tail = *s->sq_tail, i = tail & *s->sq_mask,
+        from = s->direct ? s->synced & ~(PCAP_SINK_ALIGN - 1) : s->synced;
+    struct io_uring_sqe *e = &((struct io_uring_sqe*)s->sqes)[i];
+
+    ZERO(*e);
+    e->opcode = IORING_OP_WRITE_FIXED;
+    e->flags = IOSQE_FIXED_FILE;
+    e->fd = 0;
+    e->addr = ptr_to_u64(s->buf + s->cur * PCAP_SINK_SEG + from);
+    e->len = to - from;
+    e->off = s->off + from;
+    e->buf_index = s->cur;
+    e->user_data = id;
+    s->sq_array[i] = i;
+    __atomic_store_n(s->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    s->len[id] = to - from;
+    s->busy |= 1U << id;
+    return _sink_enter(s, 1, 0);
+}
+
+// queues len bytes of the current segment and moves to the next one,
+// waiting only when every segment is still in flight
+int
+_sink_submit(struct pcap_sink *s, uint32_t len) {
+    int ret = 0;
+
+    TRY(!(ret = _sink_queue(s, len, s->cur)), return ret);
+    s->off += len;
+    s->cur = (s->cur + 1) % PCAP_SINK_NSEG;
+    s->n = s->synced = 0;
+    ret = _sink_reap(s);
+    while (!ret && (s->busy & (1U << s->cur))) {
+        TRY(!(ret = _sink_enter(s, 0, 1)), return ret);
+        ret = _sink_reap(s);
+    }
+    return ret;
+}
+
+void
+_sink_free(struct pcap_sink *s) {
+    if (s->buf && s->buf != MAP_FAILED)
+        munmap(s->buf, PCAP_SINK_NSEG * PCAP_SINK_SEG);
+    if (s->sqes && s->sqes != MAP_FAILED) munmap(s->sqes, s->sqes_size);
+    if (s->rings && s->rings != MAP_FAILED) munmap(s->rings, s->rings_size);
+    if (s->ring > 0) close(s->ring);
+    if (s->fd > 0) close(s->fd);
+    ZERO(*s);
+    s->ring = s->fd = -1;
+}
+
+int
+pcap_sink_open(struct pcap_sink *s, char *fn) {
+    struct io_uring_params p = {0};
+    struct pcap_file_header h;
+    struct iovec iov[PCAP_SINK_NSEG];
+    uint8_t *r;
+    int ret = 0, i;
+
+    ZERO(*s);
+    s->ring = s->fd = -1;
+    // O_DIRECT where the filesystem takes it, buffered otherwise
+    s->direct = (s->fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644))
+        != -1;
+    if (!s->direct)
+        TRY((s->fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644)) != -1,
+            RETURN(errno, err));
+
+    TRY((s->ring = syscall(__NR_io_uring_setup, PCAP_SINK_NSEG, &p)) != -1,
+        RETURN(errno, err));
+    TRY(p.features & IORING_FEAT_SINGLE_MMAP, RETURN(ENOSYS, err));
+    s->rings_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+        s->rings_size)
+        s->rings_size = p.cq_off.cqes +
+            p.cq_entries * sizeof(struct io_uring_cqe);
+    TRY((s->rings = mmap(NULL, s->rings_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, s->ring, IORING_OFF_SQ_RING))
+        != MAP_FAILED, RETURN(errno, err));
+    s->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    TRY((s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, s->ring, IORING_OFF_SQES))
+        != MAP_FAILED, RETURN(errno, err));
+    r = s->rings;
+    s->sq_tail = (uint32_t*)(r + p.sq_off.tail);
+    s->sq_mask = (uint32_t*)(r + p.sq_off.ring_mask);
+    s->sq_array = (uint32_t*)(r + p.sq_off.array);
+    s->cq_head = (uint32_t*)(r + p.cq_off.head);
+    s->cq_tail = (uint32_t*)(r + p.cq_off.tail);
+    s->cq_mask = (uint32_t*)(r + p.cq_off.ring_mask);
+    s->cqes = r + p.cq_off.cqes;
+
+    // page aligned, so every full segment is an aligned O_DIRECT write
+    TRY((s->buf = mmap(NULL, PCAP_SINK_NSEG * PCAP_SINK_SEG,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+        -1, 0)) != MAP_FAILED, RETURN(errno, err));
+    for (i = 0; i < PCAP_SINK_NSEG; i++)
+        iov[i] = (struct iovec){s->buf + i * PCAP_SINK_SEG, PCAP_SINK_SEG};
+    TRY(!syscall(__NR_io_uring_register, s->ring, IORING_REGISTER_BUFFERS,
+        iov, PCAP_SINK_NSEG), RETURN(errno, err));
+    TRY(!syscall(__NR_io_uring_register, s->ring, IORING_REGISTER_FILES,
+        &s->fd, 1), RETURN(errno, err));
+
+    _pcap_file_header(&h);
+    ret = pcap_sink_write(s, &h, sizeof(h));
+err:
+    if (ret) _sink_free(s);
+    return ret;
+}
+
+int
+pcap_sink_write(struct pcap_sink *s, void *p0, size_t size) {
+    uint8_t *p = p0;
+    size_t n;
+    int ret = 0;
+
+    while (size > 0) {
+        n = PCAP_SINK_SEG - s->n;
+        n = size < n ? size : n;
+        memcpy(s->buf + s->cur * PCAP_SINK_SEG + s->n, p, n);
+        s->n += n;
+        p += n;
+        size -= n;
+        if (s->n == PCAP_SINK_SEG)
+            TRY(!(ret = _sink_submit(s, PCAP_SINK_SEG)), return ret);
+    }
+    return 0;
+}
+
+int
+pcap_sink_writev(struct pcap_sink *s, struct iovec *iov, int n) {
+    int ret = 0;
+
+    for (; n > 0; n--, iov++)
+        TRY(!(ret = pcap_sink_write(s, iov->iov_base, iov->iov_len)),
+            return ret);
+    return 0;
+}
+
+/*
+  puts what the current segment holds on disk without giving it up: the
+  new bytes go out padded to the block size, the flush waits for that
+  write and cuts the file back to its real size. Meant for idle moments,
+  a full segment's write later covers the same bytes again
+*/
+int
+pcap_sink_flush(struct pcap_sink *s) {
+    uint32_t pad, id = PCAP_SINK_NSEG;
+    int ret = 0;
+
+    if (s->ring <= 0 || s->n == s->synced)
+        return 0;
+    pad = s->direct ? -s->n & (PCAP_SINK_ALIGN - 1) : 0;
+    memset(s->buf + s->cur * PCAP_SINK_SEG + s->n, 0, pad);
+    TRY(!(ret = _sink_queue(s, s->n + pad, id)), return ret);
+    while (!ret && (s->busy & (1U << id))) {
+        TRY(!(ret = _sink_enter(s, 0, 1)), return ret);
+        ret = _sink_reap(s);
+    }
+    if (!ret && pad)
+        TRY(!ftruncate(s->fd, s->off + s->n), return errno);
+    if (!ret)
+        s->synced = s->n;
+    return ret;
+}
+
+// waits for every write, a zeroed sink is not open
+int
+pcap_sink_close(struct pcap_sink *s) {
+    uint64_t size = s->off + s->n;
+    uint32_t pad;
+    int ret = 0;
+
+    if (s->ring <= 0)
+        return 0;
+    // the tail goes out padded to the block size, then is cut back
+    pad = s->direct ? -s->n & (PCAP_SINK_ALIGN - 1) : 0;
+    if (s->n != s->synced) {
+        memset(s->buf + s->cur * PCAP_SINK_SEG + s->n, 0, pad);
+        ret = _sink_submit(s, s->n + pad);
+    }
+    while (!ret && s->busy) {
+        TRY(!(ret = _sink_enter(s, 0, 1)), break);
+        ret = _sink_reap(s);
+    }
+    if (!ret && pad)
+        TRY(!ftruncate(s->fd, size), ret = errno);
+    _sink_free(s);
+    return ret;
+}
+
+int
+_lat_idx(uint64_t v) {
+    int e;
+
+    if (v < 1UL << LAT_SUB_BITS)
+        return v;
+    e = 63 - __builtin_clzl(v);
+    return (e - LAT_SUB_BITS + 1) << LAT_SUB_BITS |
+        ((v >> (e - LAT_SUB_BITS)) & ((1UL << LAT_SUB_BITS) - 1));
+}
+
+// largest value falling into bucket i
+uint64_t
+_lat_val(int i) {
+    int e = (i >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t m = i & ((1UL << LAT_SUB_BITS) - 1);
+
+    if (i < 1 << LAT_SUB_BITS)
+        return i;
+    return ((1UL << LAT_SUB_BITS | m) << (e - LAT_SUB_BITS)) +
+        (1UL << (e - LAT_SUB_BITS)) - 1;
+}
+
+// clock skew between the stamps can make v negative, counted as 0
+void
+lat_add(struct lat_hist *h, int64_t v) {
+    if (v < 0)
+        v = 0;
+    h->b[_lat_idx(v)]++;
+    h->n++;
+    if ((uint64_t)v > h->max)
+        h->max = v;
+}
+
+uint64_t
+lat_pct(struct lat_hist *h, double pct) {
+    double rank = pct / 100 * h->n;
+    uint64_t want = rank, seen = 0, v;
+    int i;
+
+    if (want < rank || !want)
+        want++;
+    for (i = 0; i < LAT_BUCKETS; i++)
+        if ((seen += h->b[i]) >= want)
+            break;
+    v = i < LAT_BUCKETS ? _lat_val(i) : h->max;
+    return v < h->max ? v : h->max;
+}
+
+void
+_lat_line(char *name, struct lat_hist *h) {
+    LOG("latency %-5s n %-9lu p50 %9.1f p99 %9.1f p999 %9.1f max %9.1f us\n",
+        name, h->n, TO_MICROSECOND(lat_pct(h, 50)),
+        TO_MICROSECOND(lat_pct(h, 99)), TO_MICROSECOND(lat_pct(h, 99.9)),
+        TO_MICROSECOND(h->max));
+}
+
+void
+lat_merge(struct lat_hist *d, struct lat_hist *s) {
+    int i;
+
+    if (!s->n)
+        return;
+    for (i = 0; i < LAT_BUCKETS; i++)
+        d->b[i] += s->b[i];
+    d->n += s->n;
+    if (s->max > d->max)
+        d->max = s->max;
+}
+
+// one line per cpu with samples, then all of them merged (nsec in, usec out)
+void
+lat_print(struct lat_hist *h, int ncpu) {
+    static struct lat_hist all;
+    char name[16];
+    int i;
+
+    ZERO(all);
+    for (i = 0; i < ncpu; i++) {
+        if (!h[i].n)
+            continue;
+        snprintf(name, sizeof(name), "cpu%d", i);
+        _lat_line(name, &h[i]);
+        lat_merge(&all, &h[i]);
+    }
+    if (all.n)
+        _lat_line("all", &all);
+    fflush(stdout);
+}
+
 void
 _sigint_handler(int sig __unused) {
     _running = 0;
@@ -1,6 +1,8 @@
 #ifndef __BPF_H__
 #define __BPF_H__
 
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <linux/ip.h>
 #include <linux/bpf.h>
 #include <arpa/inet.h>
@@ -57,7 +59,7 @@
 #define bpf_lsh4(d, s)      bpf_ins(BPF_LSH |BPF_R|BPF_ALU4, d, s, 0, 0)
 #define bpf_rsh4(d, s)      bpf_ins(BPF_RSH |BPF_R|BPF_ALU4, d, s, 0, 0)
 #define bpf_mod4(d, s)      bpf_ins(BPF_MOD |BPF_R|BPF_ALU4, d, s, 0, 0)
-#define bpf_xor4(d, s)      bpf_ins(BPF_ROR |BPF_R|BPF_ALU4, d, s, 0, 0)
+#define bpf_xor4(d, s)      bpf_ins(BPF_XOR |BPF_R|BPF_ALU4, d, s, 0, 0)
 #define bpf_mov4(d, s)      bpf_ins(BPF_MOV |BPF_R|BPF_ALU4, d, s, 0, 0)
 #define bpf_arsh4(d, s)     bpf_ins(BPF_ARSH|BPF_R|BPF_ALU4, d, s, 0, 0)
 #define bpf_sdiv4(d, s)     bpf_ins(BPF_DIV |BPF_R|BPF_ALU4, d, s, 1, 0)
@@ -71,7 +73,7 @@
 #define bpf_lsh4i(d, s)     bpf_ins(BPF_LSH |BPF_I|BPF_ALU4, d, 0, 0, s)
 #define bpf_rsh4i(d, s)     bpf_ins(BPF_RSH |BPF_I|BPF_ALU4, d, 0, 0, s)
 #define bpf_mod4i(d, s)     bpf_ins(BPF_MOD |BPF_I|BPF_ALU4, d, 0, 0, s)
-#define bpf_xor4i(d, s)     bpf_ins(BPF_ROR |BPF_I|BPF_ALU4, d, 0, 0, s)
+#define bpf_xor4i(d, s)     bpf_ins(BPF_XOR |BPF_I|BPF_ALU4, d, 0, 0, s)
 #define bpf_mov4i(d, s)     bpf_ins(BPF_MOV |BPF_I|BPF_ALU4, d, 0, 0, s)
 #define bpf_arsh4i(d, s)    bpf_ins(BPF_ARSH|BPF_I|BPF_ALU4, d, 0, 0, s)
 #define bpf_neg4(d)         bpf_ins(BPF_NEG |BPF_I|BPF_ALU4, d, 0, 0, 0)
@@ -86,7 +88,7 @@
 #define bpf_lsh8(d, s)      bpf_ins(BPF_LSH |BPF_R|BPF_ALU8, d, s, 0, 0)
 #define bpf_rsh8(d, s)      bpf_ins(BPF_RSH |BPF_R|BPF_ALU8, d, s, 0, 0)
 #define bpf_mod8(d, s)      bpf_ins(BPF_MOD |BPF_R|BPF_ALU8, d, s, 0, 0)
-#define bpf_xor8(d, s)      bpf_ins(BPF_ROR |BPF_R|BPF_ALU8, d, s, 0, 0)
+#define bpf_xor8(d, s)      bpf_ins(BPF_XOR |BPF_R|BPF_ALU8, d, s, 0, 0)
 #define bpf_mov8(d, s)      bpf_ins(BPF_MOV |BPF_R|BPF_ALU8, d, s, 0, 0)
 #define bpf_arsh8(d, s)     bpf_ins(BPF_ARSH|BPF_R|BPF_ALU8, d, s, 0, 0)
 #define bpf_sdiv8(d, s)     bpf_ins(BPF_DIV |BPF_R|BPF_ALU8, d, s, 1, 0)
@@ -100,7 +102,7 @@
 #define bpf_lsh8i(d, s)     bpf_ins(BPF_LSH |BPF_I|BPF_ALU8, d, 0, 0, s)
 #define bpf_rsh8i(d, s)     bpf_ins(BPF_RSH |BPF_I|BPF_ALU8, d, 0, 0, s)
 #define bpf_mod8i(d, s)     bpf_ins(BPF_MOD |BPF_I|BPF_ALU8, d, 0, 0, s)
-#define bpf_xor8i(d, s)     bpf_ins(BPF_ROR |BPF_I|BPF_ALU8, d, 0, 0, s)
+#define bpf_xor8i(d, s)     bpf_ins(BPF_XOR |BPF_I|BPF_ALU8, d, 0, 0, s)
 #define bpf_mov8i(d, s)     bpf_ins(BPF_MOV |BPF_I|BPF_ALU8, d, 0, 0, s)
 #define bpf_arsh8i(d, s)    bpf_ins(BPF_ARSH|BPF_I|BPF_ALU8, d, 0, 0, s)
 #define bpf_neg8(d)         bpf_ins(BPF_NEG |BPF_I|BPF_ALU8, d, 0, 0, 0)
@@ -254,6 +256,36 @@
     bpf_mov8i(bpf_r3, BPF_ANY), \
     bpf_ret_call(map_push_elem, 0, ret)
 
+// 20 ins: bpf_map_push counting failures in the u64 at drops[0]
+#define bpf_map_push_drop(map, pos, drops, ret) \
+    bpf_imm8_map_ld(bpf_r1, map), \
+    bpf_mov8(bpf_r2, bpf_fp), \
+    bpf_add8i(bpf_r2, pos), \
+    bpf_mov8i(bpf_r3, BPF_ANY), \
+    bpf_call(map_push_elem), \
+    bpf_jeq8i(bpf_r0, 0, 13), \
+    bpf_st4i(bpf_fp, pos, 0), \
+    bpf_map_get(drops, pos, ret), \
+    bpf_mov8i(bpf_r1, 1), \
+    bpf_atom_add8(bpf_r0, 0, bpf_r1), \
+    bpf_return(ret)
+
+// 8 ins: r0 = &map[*(u32*)(fp + pos)]
+#define bpf_map_get(map, pos, ret) \
+    bpf_imm8_map_ld(bpf_r1, map), \
+    bpf_mov8(bpf_r2, bpf_fp), \
+    bpf_add8i(bpf_r2, pos), \
+    bpf_call(map_lookup_elem), \
+    bpf_jne8i(bpf_r0, 0, 2), \
+    bpf_return(ret)
+
+// 5 ins: only falls through when map[idx] is empty
+#define bpf_tail_call(map, idx) \
+    bpf_mov8(bpf_r1, bpf_r9), \
+    bpf_imm8_map_ld(bpf_r2, map), \
+    bpf_mov8(bpf_r3, idx), \
+    bpf_call(tail_call)
+
 // 6 ins
 #define _bpf_stack_zero(n, s) \
     bpf_mov8i(bpf_r2, n), \
@@ -267,23 +299,134 @@
 #define bpf_stack_zero2(n) _bpf_stack_zero(n, 2)
 #define bpf_stack_zero(n)  _bpf_stack_zero(n, 1)
 
+// 31 ins: d = log2(s), s and t are clobbered, log2(0) = 0
+#define _bpf_log2(d, s, t, n) \
+    bpf_mov8(t, s), \
+    bpf_rsh8i(t, n), \
+    bpf_jeq8i(t, 0, 2), \
+    bpf_mov8(s, t), \
+    bpf_add8i(d, n)
+#define bpf_log2(d, s, t) \
+    bpf_mov8i(d, 0), \
+    _bpf_log2(d, s, t, 32), \
+    _bpf_log2(d, s, t, 16), \
+    _bpf_log2(d, s, t, 8), \
+    _bpf_log2(d, s, t, 4), \
+    _bpf_log2(d, s, t, 2), \
+    _bpf_log2(d, s, t, 1)
+
 #define eth_proto_off offsetof(struct ethhdr, h_proto)
 #define ip_len_off (ETH_HLEN + offsetof(struct iphdr, tot_len))
 #define ptr_to_u64(p) (__u64)(p)
 
+// pcap record header, little-endian
+struct pcap_pkthdr {
+    uint32_t sec, usec, caplen, len;
+};
+
+/*
+  pcap sidecar index (<file>.idx): a header, then one entry per time bucket
+  holding the offset of the bucket's first record and a bloom filter of the
+  direction-independent 5-tuples seen in it, all in host byte order
+*/
+
+#define PCAP_INDEX_MAGIC 0x58444950 // PIDX
+#define PCAP_INDEX_BUCKET 1000000 // usec
+#define PCAP_BLOOM_BITS 4096
+
+struct pcap_index_hdr {
+    uint32_t magic, bucket;
+};
+
+struct pcap_index_ent {
+    uint64_t usec, off;
+    uint32_t count, pad;
+    uint64_t bloom[PCAP_BLOOM_BITS / 64];
+};
+
+struct pcap_flow {
+    uint32_t saddr, daddr;
+    uint16_t sport, dport;
+    uint8_t proto, pad[3];
+};
+
+struct pcap_index {
+    int fd;
+    uint64_t off; // pcap offset of the next record
+    struct pcap_index_ent e;
+};
+
+/*
+  io_uring pcap writer: records are appended to PCAP_SINK_NSEG registered
+  segments, each full segment goes out as one fixed-buffer write to the
+  registered fd (O_DIRECT when supported) and is refilled once its
+  completion is reaped, so up to PCAP_SINK_NSEG - 1 writes are in flight.
+  pcap_sink_flush() writes the partial segment synchronously in between
+*/
+
+#define PCAP_SINK_SEG (1 << 20)
+#define PCAP_SINK_NSEG 8
+#define PCAP_SINK_ALIGN 4096
+
+struct pcap_sink {
+    int fd, ring, direct, cur; // cur: segment being filled
+    size_t n, synced; // bytes in it, bytes of it already flushed
+    uint64_t off; // file offset of cur
+    uint32_t busy, len[PCAP_SINK_NSEG + 1]; // in-flight segments, flush
+    uint8_t *buf;
+    void *rings, *sqes, *cqes;
+    size_t rings_size, sqes_size;
+    uint32_t *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+};
+
+/*
+  HDR-style latency histogram: values below 2^LAT_SUB_BITS are exact and
+  every power of two above is split into 2^LAT_SUB_BITS linear buckets, so
+  a percentile is within ~3% of the recorded value
+*/
+
+#define LAT_SUB_BITS 5
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct lat_hist {
+    uint64_t n, max, b[LAT_BUCKETS];
+};
+
 void bpf_init(void);
 int bpf_is_running(void);
 void bpf_print(struct bpf_insn*, size_t);
 int bpf_map_create(int*, __u32, __u32, __u32, __u32);
 int bpf_map_lookup(__u32, void*, void*);
 int bpf_map_pop(__u32, void*);
+int bpf_map_update(__u32, void*, void*, __u64);
+int bpf_map_delete(__u32, void*);
+int bpf_map_next(__u32, void*, void*);
 int bpf_prog_load(int*, __u32, struct bpf_insn*, __u32, char*, uint32_t);
 int if_attach(int*, char*, int);
+int if_attach_fanout(int*, char*, int, uint16_t, uint16_t, int);
+int uprobe_attach(int*, char*, uint64_t, int, int);
 void eth_ip_addr(char*, char*, struct ethhdr*);
 char* eth_proto_name(uint16_t);
 char* ip_proto_name(uint8_t);
 int file_write(int, void*, size_t);
+int file_writev(int, struct iovec*, int);
 int pcap_open(int*, char*);
-int pcap_write(int, void*, uint32_t);
+void pcap_rec(struct pcap_pkthdr*, uint32_t, struct timeval*);
+int pcap_write(int, void*, uint32_t, struct timeval*);
+void pcap_bloom_add(uint64_t*, struct pcap_flow*);
+int pcap_bloom_has(uint64_t*, struct pcap_flow*);
+int pcap_index_open(struct pcap_index*, char*);
+int pcap_index_add(struct pcap_index*, struct timeval*, struct pcap_flow*,
+    uint32_t);
+int pcap_index_close(struct pcap_index*);
+int pcap_sink_open(struct pcap_sink*, char*);
+int pcap_sink_write(struct pcap_sink*, void*, size_t);
+int pcap_sink_writev(struct pcap_sink*, struct iovec*, int);
+int pcap_sink_flush(struct pcap_sink*);
+int pcap_sink_close(struct pcap_sink*);
+void lat_add(struct lat_hist*, int64_t);
+uint64_t lat_pct(struct lat_hist*, double);
+void lat_merge(struct lat_hist*, struct lat_hist*);
+void lat_print(struct lat_hist*, int);
 
 #endif
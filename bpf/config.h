@@ -1,7 +1,8 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
-#define IFACE "wlp0s20f3"
+// overridable from the environment, e.g. IFACE=veth0 ./ipdump
+#define IFACE (getenv("IFACE") ? getenv("IFACE") : "wlp0s20f3")
 #define NCPU 64
 
 #endif
@@ -0,0 +1,290 @@
+#include "bpf.h"
+#include "config.h"
+#include "../tools.h"
+
+/*
+  root -> eth[ethertype] -> ip[protocol] -> ...
+  Every stage reads and updates the per-cpu scratch record, a stage
+  without a successor in the prog arrays pushes it to the queue. Parsers
+  can be replaced at runtime with bpf_map_update on eth/ip.
+*/
+
+struct rec_t {
+    uint8_t src[16], dst[16];
+    uint32_t off, len;
+    uint16_t sport, dport;
+    uint16_t eth;
+    uint8_t proto, pad;
+};
+
+enum { ROOT, VLAN, IPV4, IPV6, IPV6_EXT, PORTS, NPROG };
+
+int eth = -1, ip = -1, scratch = -1, queue = -1;
+int prog[NPROG] = {-1, -1, -1, -1, -1, -1};
+
+#define rec_off(f) offsetof(struct rec_t, f)
+
+// 11 ins: r6 = &scratch[0]
+#define scratch_get() \
+    bpf_mov8(bpf_r9, bpf_r1), \
+    bpf_st4i(bpf_fp, -4, 0), \
+    bpf_map_get(scratch, -4, -1), \
+    bpf_mov8(bpf_r6, bpf_r0)
+
+// 7 ins
+#define rec_push() \
+    bpf_imm8_map_ld(bpf_r1, queue), \
+    bpf_mov8(bpf_r2, bpf_r6), \
+    bpf_mov8i(bpf_r3, BPF_ANY), \
+    bpf_call(map_push_elem), \
+    bpf_return(-1)
+
+// 9 ins: load len bytes at r7 to fp + pos
+#define rec_load(pos, len) \
+    bpf_mov8(bpf_r1, bpf_r9), \
+    bpf_mov8(bpf_r2, bpf_r7), \
+    bpf_mov8(bpf_r3, bpf_fp), \
+    bpf_add8i(bpf_r3, pos), \
+    bpf_mov8i(bpf_r4, len), \
+    bpf_ret_call(skb_load_bytes, 0, -1)
+
+int
+parser_load(int *p, struct bpf_insn *insns, __u32 n) {
+    bpf_print(insns, n);
+    return bpf_prog_load(p, BPF_PROG_TYPE_SOCKET_FILTER, insns, n,
+        "MIT", 10 * MB);
+}
+
+int
+root_load(int *p) {
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_st4i(bpf_r6, rec_off(off), ETH_HLEN),
+        bpf_ld4(bpf_r7, bpf_r9, offsetof(struct __sk_buff, protocol)),
+        bpf_be2(bpf_r7),
+        bpf_tail_call(eth, bpf_r7),
+        bpf_return(-1),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+vlan_load(int *p) {
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_ld4(bpf_r7, bpf_r6, rec_off(off)),
+        rec_load(-8, 4),
+        bpf_add8i(bpf_r7, 4),
+        bpf_st4(bpf_r6, rec_off(off), bpf_r7),
+        bpf_ld2(bpf_r7, bpf_fp, -6),
+        bpf_be2(bpf_r7),
+        bpf_tail_call(eth, bpf_r7),
+        bpf_return(-1),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+ipv4_load(int *p) {
+    int h = -24;
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_ld4(bpf_r7, bpf_r6, rec_off(off)),
+        rec_load(h, sizeof(struct iphdr)),
+
+        bpf_st2i(bpf_r6, rec_off(eth), ETH_P_IP),
+        bpf_st4i(bpf_r6, rec_off(sport), 0),
+        bpf_ld4(bpf_r1, bpf_fp, h + offsetof(struct iphdr, saddr)),
+        bpf_st4(bpf_r6, rec_off(src), bpf_r1),
+        bpf_st4i(bpf_r6, rec_off(src) + 4, 0),
+        bpf_st8i(bpf_r6, rec_off(src) + 8, 0),
+        bpf_ld4(bpf_r1, bpf_fp, h + offsetof(struct iphdr, daddr)),
+        bpf_st4(bpf_r6, rec_off(dst), bpf_r1),
+        bpf_st4i(bpf_r6, rec_off(dst) + 4, 0),
+        bpf_st8i(bpf_r6, rec_off(dst) + 8, 0),
+
+        bpf_ld2(bpf_r1, bpf_fp, h + offsetof(struct iphdr, tot_len)),
+        bpf_be2(bpf_r1),
+        bpf_add8(bpf_r1, bpf_r7),
+        bpf_st4(bpf_r6, rec_off(len), bpf_r1),
+        bpf_ld1(bpf_r1, bpf_fp, h),
+        bpf_and8i(bpf_r1, 0xf),
+        bpf_lsh8i(bpf_r1, 2),
+        bpf_add8(bpf_r1, bpf_r7),
+        bpf_st4(bpf_r6, rec_off(off), bpf_r1),
+        bpf_ld1(bpf_r7, bpf_fp, h + offsetof(struct iphdr, protocol)),
+        bpf_st1(bpf_r6, rec_off(proto), bpf_r7),
+
+        // only the first fragment carries the l4 header
+        bpf_ld2(bpf_r1, bpf_fp, h + offsetof(struct iphdr, frag_off)),
+        bpf_be2(bpf_r1),
+        bpf_jset8i(bpf_r1, 0x1fff, 5),
+        bpf_tail_call(ip, bpf_r7),
+        rec_push(),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+ipv6_load(int *p) {
+    int h = -48;
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_ld4(bpf_r7, bpf_r6, rec_off(off)),
+        rec_load(h, sizeof(struct ipv6hdr)),
+
+        bpf_st2i(bpf_r6, rec_off(eth), ETH_P_IPV6),
+        bpf_st4i(bpf_r6, rec_off(sport), 0),
+        bpf_ld8(bpf_r1, bpf_fp, h + offsetof(struct ipv6hdr, saddr)),
+        bpf_st8(bpf_r6, rec_off(src), bpf_r1),
+        bpf_ld8(bpf_r1, bpf_fp, h + offsetof(struct ipv6hdr, saddr) + 8),
+        bpf_st8(bpf_r6, rec_off(src) + 8, bpf_r1),
+        bpf_ld8(bpf_r1, bpf_fp, h + offsetof(struct ipv6hdr, daddr)),
+        bpf_st8(bpf_r6, rec_off(dst), bpf_r1),
+        bpf_ld8(bpf_r1, bpf_fp, h + offsetof(struct ipv6hdr, daddr) + 8),
+        bpf_st8(bpf_r6, rec_off(dst) + 8, bpf_r1),
+
+        bpf_add8i(bpf_r7, sizeof(struct ipv6hdr)),
+        bpf_ld2(bpf_r1, bpf_fp, h + offsetof(struct ipv6hdr, payload_len)),
+        bpf_be2(bpf_r1),
+        bpf_add8(bpf_r1, bpf_r7),
+        bpf_st4(bpf_r6, rec_off(len), bpf_r1),
+        bpf_st4(bpf_r6, rec_off(off), bpf_r7),
+        bpf_ld1(bpf_r7, bpf_fp, h + offsetof(struct ipv6hdr, nexthdr)),
+        bpf_st1(bpf_r6, rec_off(proto), bpf_r7),
+
+        bpf_tail_call(ip, bpf_r7),
+        rec_push(),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+ipv6_ext_load(int *p) {
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_ld4(bpf_r7, bpf_r6, rec_off(off)),
+        rec_load(-8, 4),
+
+        // fragment header has a fixed size, the others (len + 1) * 8
+        bpf_ld1(bpf_r8, bpf_r6, rec_off(proto)),
+        bpf_ld1(bpf_r1, bpf_fp, -7),
+        bpf_add8i(bpf_r1, 1),
+        bpf_lsh8i(bpf_r1, 3),
+        bpf_mov8i(bpf_r2, 0),
+        bpf_jne8i(bpf_r8, IPPROTO_FRAGMENT, 4),
+        bpf_mov8i(bpf_r1, 8),
+        bpf_ld2(bpf_r2, bpf_fp, -6),
+        bpf_be2(bpf_r2),
+        bpf_and8i(bpf_r2, 0xfff8),
+        bpf_add8(bpf_r7, bpf_r1),
+        bpf_st4(bpf_r6, rec_off(off), bpf_r7),
+        bpf_ld1(bpf_r7, bpf_fp, -8),
+        bpf_st1(bpf_r6, rec_off(proto), bpf_r7),
+
+        // only the first fragment carries the l4 header
+        bpf_jne8i(bpf_r2, 0, 5),
+        bpf_tail_call(ip, bpf_r7),
+        rec_push(),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+ports_load(int *p) {
+    struct bpf_insn insns[] = {
+        scratch_get(),
+        bpf_mov8(bpf_r1, bpf_r9),
+        bpf_ld4(bpf_r2, bpf_r6, rec_off(off)),
+        bpf_mov8(bpf_r3, bpf_r6),
+        bpf_add8i(bpf_r3, rec_off(sport)),
+        bpf_mov8i(bpf_r4, 4),
+        bpf_ret_call(skb_load_bytes, 0, -1),
+        rec_push(),
+    };
+    return parser_load(p, insns, LEN(insns));
+}
+
+int
+parser_set(int map, uint32_t key, int p) {
+    return bpf_map_update(map, &key, &prog[p], BPF_ANY);
+}
+
+void
+rec_print(struct rec_t *r) {
+    char src[INET6_ADDRSTRLEN+8], dst[INET6_ADDRSTRLEN+8];
+    int af = r->eth == ETH_P_IP ? AF_INET : AF_INET6;
+    size_t n;
+
+    inet_ntop(af, r->src, src, INET6_ADDRSTRLEN);
+    inet_ntop(af, r->dst, dst, INET6_ADDRSTRLEN);
+    if (r->sport || r->dport) {
+        n = strlen(src);
+        snprintf(src + n, sizeof(src) - n, ":%d", ntohs(r->sport));
+        n = strlen(dst);
+        snprintf(dst + n, sizeof(dst) - n, ":%d", ntohs(r->dport));
+    }
+    LOG("%5s %6s %5d %21s > %-21s\n", eth_proto_name(htons(r->eth)),
+        ip_proto_name(r->proto), r->len, src, dst);
+}
+
+int
+main(void) {
+    int sock = -1, ret = 0, i;
+    struct rec_t r;
+
+    bpf_init();
+    TRY(!(ret = bpf_map_create(&eth, BPF_MAP_TYPE_PROG_ARRAY, 4, 4,
+        64 * KB)), goto err);
+    TRY(!(ret = bpf_map_create(&ip, BPF_MAP_TYPE_PROG_ARRAY, 4, 4,
+        256)), goto err);
+    TRY(!(ret = bpf_map_create(&scratch, BPF_MAP_TYPE_PERCPU_ARRAY, 4,
+        sizeof(r), 1)), goto err);
+    TRY(!(ret = bpf_map_create(&queue, BPF_MAP_TYPE_QUEUE, 0,
+        sizeof(r), MB)), goto err);
+
+    TRY(!(ret = root_load(&prog[ROOT])), goto err);
+    TRY(!(ret = vlan_load(&prog[VLAN])), goto err);
+    TRY(!(ret = ipv4_load(&prog[IPV4])), goto err);
+    TRY(!(ret = ipv6_load(&prog[IPV6])), goto err);
+    TRY(!(ret = ipv6_ext_load(&prog[IPV6_EXT])), goto err);
+    TRY(!(ret = ports_load(&prog[PORTS])), goto err);
+
+    TRY(!(ret = parser_set(eth, ETH_P_8021Q, VLAN)), goto err);
+    TRY(!(ret = parser_set(eth, ETH_P_8021AD, VLAN)), goto err);
+    TRY(!(ret = parser_set(eth, ETH_P_IP, IPV4)), goto err);
+    TRY(!(ret = parser_set(eth, ETH_P_IPV6, IPV6)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_HOPOPTS, IPV6_EXT)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_ROUTING, IPV6_EXT)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_FRAGMENT, IPV6_EXT)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_DSTOPTS, IPV6_EXT)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_TCP, PORTS)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_UDP, PORTS)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_UDPLITE, PORTS)), goto err);
+    TRY(!(ret = parser_set(ip, IPPROTO_SCTP, PORTS)), goto err);
+
+    TRY(!(ret = if_attach(&sock, IFACE, prog[ROOT])), goto err);
+
+    while (bpf_is_running()) {
+        TINYSLEEP();
+
+        ret = bpf_map_pop(queue, &r);
+        if (ret == ENOENT) {
+            ret = 0;
+            continue;
+        }
+        TRY(!ret, goto err);
+        rec_print(&r);
+    }
+
+err:
+    if (sock > 0) close(sock);
+    for (i = 0; i < NPROG; i++)
+        if (prog[i] > 0) close(prog[i]);
+    if (queue > 0) close(queue);
+    if (scratch > 0) close(scratch);
+    if (ip > 0) close(ip);
+    if (eth > 0) close(eth);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
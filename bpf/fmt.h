@@ -0,0 +1,298 @@
+#ifndef __FMT_H__
+#define __FMT_H__
+
+#include "bpf.h"
+#include "../tools.h"
+
+/*
+  allocation-free formatting of per-packet lines into one large buffer,
+  flushed with a single write per batch: hand-rolled integers and IPv4/IPv6
+  addresses, protocol names from tables instead of the HEXSTR buffer
+*/
+
+#define FMT_BUF (256 * KB)
+#define FMT_LINE 256 // room always left for one record
+
+enum { FMT_TEXT, FMT_CSV, FMT_BIN };
+
+struct fmt {
+    int fd, mode;
+    size_t n;
+    char buf[FMT_BUF];
+};
+
+static const char _fmt_digits[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+static const char _fmt_hex[] = "0123456789abcdef";
+
+static const char *const fmt_ip_proto[256] = {
+    [IPPROTO_ICMP] = "ICMP", [IPPROTO_IGMP] = "IGMP",
+    [IPPROTO_TCP] = "TCP", [IPPROTO_UDP] = "UDP",
+    [IPPROTO_GRE] = "GRE", [IPPROTO_ESP] = "ESP",
+    [IPPROTO_ICMPV6] = "ICMPV6", [IPPROTO_SCTP] = "SCTP",
+};
+
+static inline int
+fmt_mode(char *s) {
+    return !strcmp(s, "csv") ? FMT_CSV : !strcmp(s, "bin") ? FMT_BIN :
+        !strcmp(s, "text") ? FMT_TEXT : -1;
+}
+
+static inline void
+fmt_init(struct fmt *f, int fd, int mode) {
+    // whatever stdio still holds goes out before our writes
+    fflush(stdout);
+    f->fd = fd;
+    f->mode = mode;
+    f->n = 0;
+}
+
+static inline int
+fmt_flush(struct fmt *f) {
+    int ret = 0;
+
+    if (f->n)
+        ret = file_write(f->fd, f->buf, f->n);
+    f->n = 0;
+    return ret;
+}
+
+// called once per record, so the appends below never check for space
+static inline int
+fmt_reserve(struct fmt *f) {
+    return f->n + FMT_LINE > sizeof(f->buf) ? fmt_flush(f) : 0;
+}
+
+static inline void
+fmt_char(struct fmt *f, char c) {
+    f->buf[f->n++] = c;
+}
+
+static inline void
+fmt_str(struct fmt *f, const char *s) {
+    while (*s)
+        f->buf[f->n++] = *s++;
+}
+
+static inline void
+fmt_mem(struct fmt *f, void *p, size_t size) {
+    memcpy(f->buf + f->n, p, size);
+    f->n += size;
+}
+
+static inline void
+fmt_u64(struct fmt *f, uint64_t v) {
+    char t[20], *p = t + sizeof(t);
+    int i;
+
+    for (; v >= 100; v /= 100) {
+        i = v % 100 * 2;
+        *--p = _fmt_digits[i + 1];
+        *--p = _fmt_digits[i];
+    }
+    if (v >= 10) {
+        *--p = _fmt_digits[v * 2 + 1];
+        *--p = _fmt_digits[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+    fmt_mem(f, p, t + sizeof(t) - p);
+}
+
+static inline void
+fmt_i64(struct fmt *f, int64_t v) {
+    if (v < 0) {
+        fmt_char(f, '-');
+        v = -(uint64_t)v;
+    }
+    fmt_u64(f, v);
+}
+
+// pad what was written since start to width with c on the left
+static inline void
+fmt_rjust(struct fmt *f, size_t start, int width, char c) {
+    int len = f->n - start, pad = width - len;
+
+    if (pad <= 0)
+        return;
+    memmove(f->buf + start + pad, f->buf + start, len);
+    memset(f->buf + start, c, pad);
+    f->n += pad;
+}
+
+static inline void
+fmt_ljust(struct fmt *f, size_t start, int width) {
+    int pad = width - (int)(f->n - start);
+
+    if (pad <= 0)
+        return;
+    memset(f->buf + f->n, ' ', pad);
+    f->n += pad;
+}
+
+// exp formats one field, then it is justified to w
+#define FMT_R(f, w, c, exp) do { \
+    size_t _s = (f)->n; \
+    exp; \
+    fmt_rjust(f, _s, w, c); \
+} while (0)
+#define FMT_L(f, w, exp) do { \
+    size_t _s = (f)->n; \
+    exp; \
+    fmt_ljust(f, _s, w); \
+} while (0)
+
+static inline void
+fmt_hex(struct fmt *f, uint64_t v, int digits) {
+    fmt_str(f, "0x");
+    while (digits--)
+        fmt_char(f, _fmt_hex[(v >> (digits * 4)) & 0xf]);
+}
+
+static inline void
+fmt_ipv4(struct fmt *f, uint32_t a) {
+    uint8_t *p = (uint8_t*)&a;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (i) fmt_char(f, '.');
+        fmt_u64(f, p[i]);
+    }
+}
+
+// RFC 5952: lowercase, no leading zeros, longest run of 2+ zero groups
+// becomes ::, IPv4-mapped and -compatible addresses end in a dotted quad
+// as inet_ntop prints them
+static inline void
+fmt_ipv6(struct fmt *f, uint8_t *a) {
+    int best = -1, nbest = 1, run, i, j;
+    uint16_t g[8];
+
+    for (i = 0; i < 8; i++)
+        g[i] = a[2 * i] << 8 | a[2 * i + 1];
+    for (i = 0; i < 8; i = j + 1) {
+        for (j = i; j < 8 && !g[j]; j++);
+        run = j - i;
+        if (run > nbest) {
+            best = i;
+            nbest = run;
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        if (i == best) {
+            fmt_str(f, "::");
+            i += nbest - 1;
+            continue;
+        }
+        if (i && i != best + nbest)
+            fmt_char(f, ':');
+        if (i == 6 && !best && (nbest == 6 ||
+            (nbest == 5 && g[5] == 0xffff))) {
+            fmt_ipv4(f, *(uint32_t*)(a + 12));
+            break;
+        }
+        for (j = 12; j > 0 && !(g[i] >> j); j -= 4);
+        for (; j >= 0; j -= 4)
+            fmt_char(f, _fmt_hex[(g[i] >> j) & 0xf]);
+    }
+}
+
+// source or destination address of an IPv4/IPv6 frame
+static inline void
+fmt_eth_ip(struct fmt *f, struct ethhdr *h, int dst) {
+    uint8_t *ip = ((uint8_t*)h) + ETH_HLEN;
+
+    switch (ntohs(h->h_proto)) {
+    case ETH_P_IP:
+        fmt_ipv4(f, dst ? ((struct iphdr*)ip)->daddr :
+            ((struct iphdr*)ip)->saddr);
+        break;
+    case ETH_P_IPV6:
+        fmt_ipv6(f, dst ? (uint8_t*)&((struct ipv6hdr*)ip)->daddr :
+            (uint8_t*)&((struct ipv6hdr*)ip)->saddr);
+        break;
+    }
+}
+
+static inline void
+fmt_eth_proto(struct fmt *f, uint16_t p) {
+    switch (ntohs(p)) {
+    case ETH_P_IP: fmt_str(f, "IP"); break;
+    case ETH_P_IPV6: fmt_str(f, "IPV6"); break;
+    default: fmt_hex(f, ntohs(p), 4);
+    }
+}
+
+static inline void
+fmt_ip_proto_name(struct fmt *f, uint8_t p) {
+    if (fmt_ip_proto[p])
+        fmt_str(f, fmt_ip_proto[p]);
+    else
+        fmt_hex(f, p, 2);
+}
+
+// FMT_BIN record of fmt_eth_hdr(): eth, len and id in host byte order,
+// addresses in network byte order with IPv4 in the first 4 bytes
+struct __packed fmt_bin {
+    uint16_t eth, len;
+    int32_t id; // -1 for IPv6
+    uint8_t proto, pad[3];
+    uint8_t src[16], dst[16];
+};
+
+// one line or record for an IPv4/IPv6 header following h
+static inline void
+fmt_eth_hdr(struct fmt *f, struct ethhdr *h) {
+    struct iphdr *ipv4 = (struct iphdr*)((uint8_t*)h + ETH_HLEN);
+    struct ipv6hdr *ipv6 = (struct ipv6hdr*)ipv4;
+    int v4 = h->h_proto == htons(ETH_P_IP);
+    uint16_t len = ntohs(v4 ? ipv4->tot_len : ipv6->payload_len);
+    int id = v4 ? ntohs(ipv4->id) : -1;
+    struct fmt_bin b = {0};
+
+    switch (f->mode) {
+    case FMT_TEXT:
+        FMT_R(f, 5, ' ', fmt_eth_proto(f, h->h_proto));
+        fmt_char(f, ' ');
+        FMT_R(f, 5, ' ', if (v4) fmt_ip_proto_name(f, ipv4->protocol));
+        fmt_char(f, ' ');
+        FMT_R(f, 5, ' ', fmt_u64(f, len));
+        fmt_char(f, ' ');
+        FMT_R(f, 5, ' ', fmt_i64(f, id));
+        fmt_char(f, ' ');
+        FMT_R(f, 15, ' ', fmt_eth_ip(f, h, 0));
+        fmt_str(f, " > ");
+        FMT_L(f, 15, fmt_eth_ip(f, h, 1));
+        fmt_char(f, '\n');
+        break;
+    case FMT_CSV:
+        fmt_eth_proto(f, h->h_proto);
+        fmt_char(f, ',');
+        fmt_ip_proto_name(f, v4 ? ipv4->protocol : ipv6->nexthdr);
+        fmt_char(f, ',');
+        fmt_u64(f, len);
+        fmt_char(f, ',');
+        fmt_i64(f, id);
+        fmt_char(f, ',');
+        fmt_eth_ip(f, h, 0);
+        fmt_char(f, ',');
+        fmt_eth_ip(f, h, 1);
+        fmt_char(f, '\n');
+        break;
+    case FMT_BIN:
+        b.eth = ntohs(h->h_proto);
+        b.len = len;
+        b.id = id;
+        b.proto = v4 ? ipv4->protocol : ipv6->nexthdr;
+        memcpy(b.src, v4 ? (void*)&ipv4->saddr : (void*)&ipv6->saddr,
+            v4 ? 4 : 16);
+        memcpy(b.dst, v4 ? (void*)&ipv4->daddr : (void*)&ipv6->daddr,
+            v4 ? 4 : 16);
+        fmt_mem(f, &b, sizeof(b));
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include <fcntl.h>
+
+#include "bpf.h"
+#include "fmt.h"
+#include "../tools.h"
+
+/*
+  per-packet line formatting throughput into /dev/null: the printf path
+  iphdr used (eth_ip_addr, *_proto_name, printf) against fmt.h in each
+  output mode
+*/
+
+#define NHDR 1024
+
+struct __packed hdr_t {
+    struct ethhdr eth;
+    union __packed {
+        struct iphdr ipv4;
+        struct ipv6hdr ipv6;
+    };
+} hdr[NHDR];
+
+struct fmt out;
+
+void
+hdr_init(void) {
+    struct hdr_t *h;
+    int i;
+
+    for (i = 0; i < NHDR; i++) {
+        h = &hdr[i];
+        if (i % 4 == 3) {
+            h->eth.h_proto = htons(ETH_P_IPV6);
+            h->ipv6.nexthdr = IPPROTO_TCP;
+            h->ipv6.payload_len = htons(40 + i);
+            inet_pton(AF_INET6, "2001:db8::1", &h->ipv6.saddr);
+            inet_pton(AF_INET6, "fe80::1:2:3:4", &h->ipv6.daddr);
+            h->ipv6.daddr.s6_addr[15] = i;
+        } else {
+            h->eth.h_proto = htons(ETH_P_IP);
+            h->ipv4.protocol = i % 2 ? IPPROTO_TCP : IPPROTO_UDP;
+            h->ipv4.tot_len = htons(60 + i);
+            h->ipv4.id = htons(i * 7);
+            h->ipv4.saddr = htonl(0x0a000000 + i);
+            h->ipv4.daddr = htonl(0xc0a80101 + i * 17);
+        }
+    }
+}
+
+long
+bench_printf(FILE *f, long n) {
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    struct hdr_t *h;
+    long start = get_time(), i;
+    int t;
+
+    for (i = 0; i < n; i++) {
+        h = &hdr[i % NHDR];
+        t = ntohs(h->eth.h_proto);
+        eth_ip_addr(src, dst, &h->eth);
+        fprintf(f, "%5s %5s %5d %5d %15s > %-15s\n",
+            eth_proto_name(h->eth.h_proto),
+            t == ETH_P_IP ? ip_proto_name(h->ipv4.protocol) : "",
+            ntohs(t == ETH_P_IP ? h->ipv4.tot_len : h->ipv6.payload_len),
+            t == ETH_P_IP ? ntohs(h->ipv4.id) : -1, src, dst);
+    }
+    fflush(f);
+    return get_time() - start;
+}
+
+long
+bench_fmt(int fd, int mode, long n) {
+    long start = get_time(), i;
+
+    fmt_init(&out, fd, mode);
+    for (i = 0; i < n; i++) {
+        ASSERT(!fmt_reserve(&out));
+        fmt_eth_hdr(&out, &hdr[i % NHDR].eth);
+    }
+    ASSERT(!fmt_flush(&out));
+    return get_time() - start;
+}
+
+void
+bench_print(char *name, long n, long t) {
+    LOG("%-8s %8.1f ns/line %8.2f Mlines/s\n", name, (double)t / n,
+        n * 1e3 / t);
+}
+
+int
+main(int argc, char **argv) {
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    FILE *f;
+    int fd;
+
+    hdr_init();
+    ASSERT((f = fopen("/dev/null", "w")));
+    ASSERT((fd = open("/dev/null", O_WRONLY)) != -1);
+
+    bench_print("printf", n, bench_printf(f, n));
+    bench_print("text", n, bench_fmt(fd, FMT_TEXT, n));
+    bench_print("csv", n, bench_fmt(fd, FMT_CSV, n));
+    bench_print("bin", n, bench_fmt(fd, FMT_BIN, n));
+
+    fclose(f);
+    close(fd);
+    return 0;
+}
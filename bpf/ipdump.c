@@ -1,70 +1,507 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 
 #include "bpf.h"
+#include "fmt.h"
 #include "config.h"
 #include "../tools.h"
 
-struct cpu_t {
-    union {
-        struct __packed {
-            struct ethhdr eth;
-            struct iphdr ip;
-            union __packed {
-                struct tcphdr tcp;
-                struct udphdr udp;
-            };
-        };
-        char data[65535];
+#define CHUNK 492 // record fills the 512 byte bpf stack
+#define NSLOT 16384 // popped chunks in flight, 8MB
+#define NIOV 1024
+
+// queue record, popped straight into a slot. ns: CLOCK_MONOTONIC when
+// the program saw the packet, the same clock as get_time()
+struct __packed pkt_t {
+    uint64_t ns;
+    uint8_t data[CHUNK];
+    uint32_t head, size, cpu;
+} slot[NSLOT];
+uint32_t spare[NSLOT], nspare = 0;
+
+// parsed in place from a packet's first chunk
+struct __packed hdr_t {
+    struct ethhdr eth;
+    struct iphdr ip;
+    union __packed {
+        struct tcphdr tcp;
+        struct udphdr udp;
     };
+};
+
+// slots of the packet being reassembled
+struct cpu_t {
+    uint32_t chunk[65535 / CHUNK + 1], n;
     int size;
 } cpu[NCPU] = {0};
 
-int pcap = -1, idx = 0;
+/*
+  completed packets are not copied together: one writev per batch gathers
+  each record header and the chunks where they were popped, and the slots
+  go back to the spare list once the write returned. Every output has its
+  own batch so -S shards interleaving on the drain loop don't cut them short
+*/
+struct batch_t {
+    int n, nrec, nslot;
+    struct iovec iov[NIOV];
+    struct pcap_pkthdr rec[NIOV / 2];
+    uint32_t slot[NIOV];
+} batch[NCPU + 1] = {0};
+
+/*
+  flight recorder: with -r/-t reassembled packets go to a preallocated ring
+  holding the last MB/seconds of traffic instead of ipdump.pcap, and the
+  ring is written to ipdump.<n>.pcap on SIGUSR1, on -d new kernel drops or
+  on a packet matching the -m port. A dump empties the ring, so the port
+  trigger stays held off until the ring refilled (its size or -t window)
+  and matches meanwhile are only counted
+
+  shards: with -S each cpu's packets go to their own ipdump.cpu<n>.pcap,
+  opened on the first packet, so writers never share a file. pcapmerge
+  puts them back in timestamp order
+
+  every pcap written continuously gets a <file>.idx time/flow index for
+  pcapquery
+
+  -u writes those pcaps through an io_uring pcap_sink: the drain loop
+  only copies into registered segments and submits, the disk completes
+  asynchronously. A pass that drained nothing, or a second without one,
+  flushes the partial segments so the pcaps keep up with their .idx
+*/
+
+struct rec_t {
+    struct timeval t;
+    uint32_t size, len; // len 0: padding up to the end of the ring
+    uint8_t data[];
+};
+
+struct ring_t {
+    uint8_t *p;
+    uint64_t size, head, tail;
+    long window; // usec, 0 keeps as much as fits
+    uint64_t mark; // head at the last dump
+    long marked; // get_time() of the last dump, 0 never dumped
+    int skipped; // port matches while held off
+} ring = {0};
+
+int idx = 0, port = -1, dumps = 0, shards = 0, uring = 0;
+struct lat_hist lat[NCPU]; // kernel to drain loop, per cpu
+// shards, then ipdump.pcap
+int pfd[NCPU + 1];
+struct pcap_sink psink[NCPU + 1];
+struct pcap_index pidx[NCPU + 1];
+struct fmt out;
+
+// -o bin record, host byte order except for the addresses
+struct __packed bin_t {
+    uint32_t idx, saddr, daddr;
+    uint16_t cpu, len, id, sport, dport;
+    uint8_t proto, pad;
+};
+volatile sig_atomic_t dump = 0; // 1 signal, 2 port match
+
+void
+sigusr1_handler(int sig __unused) {
+    dump = 1;
+}
+
+// output i, opened on first use with its index
+int
+out_open(int i) {
+    char fn[32];
+    int ret = 0;
+
+    if (uring ? psink[i].ring > 0 : pfd[i] > 0)
+        return 0;
+    if (i == NCPU)
+        snprintf(fn, sizeof(fn), "ipdump.pcap");
+    else
+        snprintf(fn, sizeof(fn), "ipdump.cpu%d.pcap", i);
+    if (uring)
+        TRY(!(ret = pcap_sink_open(&psink[i], fn)), goto err);
+    else
+        TRY(!(ret = pcap_open(&pfd[i], fn)), goto err);
+    TRY(!(ret = pcap_index_open(&pidx[i], fn)), goto err);
+    return 0;
+
+err:
+    // never left half open, the next packet starts over
+    if (pfd[i] > 0) close(pfd[i]);
+    pfd[i] = -1;
+    pcap_sink_close(&psink[i]);
+    if (pidx[i].fd > 0) close(pidx[i].fd);
+    pidx[i].fd = -1;
+    return ret;
+}
+
+int
+ring_init(size_t size, int huge) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+    ring.size = size;
+    if (huge) {
+        ring.p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            flags | MAP_HUGETLB, -1, 0);
+        if (ring.p != MAP_FAILED)
+            return 0;
+        LOGERR("hugepages: %s, falling back to 4K pages\n", strerror(errno));
+    }
+    TRY((ring.p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0))
+        != MAP_FAILED, return errno);
+    return 0;
+}
+
+// oldest record, skipping padding
+struct rec_t*
+ring_first(void) {
+    uint64_t off;
+    struct rec_t *r;
+
+    while (ring.tail != ring.head) {
+        off = ring.tail % ring.size;
+        r = (struct rec_t*)(ring.p + off);
+        if (ring.size - off >= sizeof(*r) && r->len)
+            return r;
+        ring.tail += ring.size - off;
+    }
+    return NULL;
+}
+
+void
+ring_push(struct cpu_t *c) {
+    uint32_t size = c->size, i, n;
+    uint64_t len = (sizeof(struct rec_t) + size + 7) & ~7UL,
+        off = ring.head % ring.size, pad = 0;
+    struct rec_t *r;
+    long now;
+
+    if (len > ring.size)
+        return;
+    if (ring.size - off < len)
+        pad = ring.size - off;
+
+    // evict whatever the new record and the padding overwrite
+    while (ring.size - (ring.head - ring.tail) < pad + len)
+        ring.tail += ring_first()->len;
+    if (pad) {
+        if (pad >= sizeof(*r))
+            ((struct rec_t*)(ring.p + off))->len = 0;
+        ring.head += pad;
+    }
+
+    r = (struct rec_t*)(ring.p + ring.head % ring.size);
+    gettimeofday(&r->t, NULL);
+    r->size = size;
+    r->len = len;
+    for (i = n = 0; i < c->n; n += slot[c->chunk[i++]].size)
+        memcpy(r->data + n, slot[c->chunk[i]].data, slot[c->chunk[i]].size);
+    ring.head += len;
+
+    now = r->t.tv_sec * 1000000L + r->t.tv_usec;
+    while (ring.window && (r = ring_first()) &&
+        now - (r->t.tv_sec * 1000000L + r->t.tv_usec) > ring.window)
+        ring.tail += r->len;
+}
+
+// the records stay in place until the next push, so they are gathered
+// like a batch: one writev per NIOV / 2 records
+int
+ring_dump(char *why) {
+    static struct pcap_pkthdr h[NIOV / 2];
+    static struct iovec iov[NIOV];
+    char fn[32];
+    struct rec_t *r;
+    int fd = -1, n = 0, k = 0, ret = 0;
+
+    snprintf(fn, sizeof(fn), "ipdump.%d.pcap", dumps++);
+    TRY(!(ret = pcap_open(&fd, fn)), goto err);
+    for (; (r = ring_first()); ring.tail += r->len, n++) {
+        if (k == NIOV) {
+            TRY(!(ret = file_writev(fd, iov, k)), goto err);
+            k = 0;
+        }
+        pcap_rec(&h[k / 2], r->size, &r->t);
+        iov[k] = (struct iovec){&h[k / 2], sizeof(h[0])};
+        iov[k + 1] = (struct iovec){r->data, r->size};
+        k += 2;
+    }
+    TRY(!(ret = file_writev(fd, iov, k)), goto err);
+    LOG("dump %s: %d packets to %s, %d port matches held off\n", why, n,
+        fn, ring.skipped);
+
+err:
+    ring.mark = ring.head;
+    ring.marked = get_time();
+    ring.skipped = 0;
+    if (fd > 0) close(fd);
+    return ret;
+}
+
+// port trigger: re-armed once the ring holds nothing from before the
+// last dump
+int
+ring_armed(void) {
+    return !ring.marked || ring.head - ring.mark >= ring.size ||
+        (ring.window &&
+            (get_time() - ring.marked) / MICROSECOND >= ring.window);
+}
+
+void
+slot_put(uint32_t s) {
+    spare[nspare++] = s;
+}
+
+int
+batch_flush(int out) {
+    struct batch_t *b = &batch[out];
+    int ret = 0, i;
+
+    if (b->n && uring)
+        ret = pcap_sink_writev(&psink[out], b->iov, b->n);
+    else if (b->n)
+        ret = file_writev(pfd[out], b->iov, b->n);
+    for (i = 0; i < b->nslot; i++)
+        slot_put(b->slot[i]);
+    b->n = b->nrec = b->nslot = 0;
+    return ret;
+}
+
+int
+batch_flush_all(void) {
+    int ret = 0, i;
+
+    for (i = 0; i <= NCPU; i++)
+        if (batch[i].n)
+            TRY(!(ret = batch_flush(i)), return ret);
+    return 0;
+}
+
+int
+slot_get(uint32_t *s) {
+    int ret = 0;
+
+    // only packets waiting in the batches can give slots back
+    if (!nspare)
+        TRY(!(ret = batch_flush_all()), return ret);
+    TRY(nspare, return ENOBUFS);
+    *s = spare[--nspare];
+    return 0;
+}
+
+void
+pkt_release(struct cpu_t *c) {
+    while (c->n)
+        slot_put(c->chunk[--c->n]);
+    c->size = 0;
+}
+
+// hands the chunks over to the output's batch
+int
+pkt_write(int out, struct cpu_t *c, struct timeval *t) {
+    struct batch_t *b = &batch[out];
+    struct pcap_pkthdr *h;
+    uint32_t i;
+    int ret = 0;
+
+    if (b->n + c->n + 1 > NIOV)
+        TRY(!(ret = batch_flush(out)), goto err);
+    h = &b->rec[b->nrec++];
+    pcap_rec(h, c->size, t);
+    b->iov[b->n++] = (struct iovec){h, sizeof(*h)};
+    for (i = 0; i < c->n; i++) {
+        b->iov[b->n++] =
+            (struct iovec){slot[c->chunk[i]].data, slot[c->chunk[i]].size};
+        b->slot[b->nslot++] = c->chunk[i];
+    }
+    c->n = c->size = 0;
+err:
+    pkt_release(c);
+    return ret;
+}
+
+void
+pkt_fmt(struct fmt *f, struct cpu_t *c, struct hdr_t *h, int len) {
+    int ports = h->ip.protocol == IPPROTO_TCP ||
+        h->ip.protocol == IPPROTO_UDP;
+    struct bin_t b = {0};
+
+    switch (f->mode) {
+    case FMT_TEXT:
+        fmt_char(f, '[');
+        FMT_R(f, 5, '0', fmt_u64(f, idx));
+        fmt_char(f, '/');
+        FMT_R(f, 2, '0', fmt_u64(f, c - cpu));
+        fmt_str(f, "] ");
+        FMT_R(f, 5, ' ', fmt_ip_proto_name(f, h->ip.protocol));
+        fmt_char(f, ' ');
+        FMT_R(f, 5, ' ', fmt_u64(f, len));
+        fmt_char(f, ' ');
+        FMT_R(f, 5, ' ', fmt_u64(f, ntohs(h->ip.id)));
+        fmt_char(f, ' ');
+        FMT_R(f, 21, ' ', {
+            fmt_ipv4(f, h->ip.saddr);
+            if (ports) {
+                fmt_char(f, ':');
+                fmt_u64(f, ntohs(h->udp.source));
+            }
+        });
+        fmt_str(f, " > ");
+        FMT_L(f, 21, {
+            fmt_ipv4(f, h->ip.daddr);
+            if (ports) {
+                fmt_char(f, ':');
+                fmt_u64(f, ntohs(h->udp.dest));
+            }
+        });
+        fmt_char(f, '\n');
+        break;
+    case FMT_CSV:
+        fmt_u64(f, idx);
+        fmt_char(f, ',');
+        fmt_u64(f, c - cpu);
+        fmt_char(f, ',');
+        fmt_ip_proto_name(f, h->ip.protocol);
+        fmt_char(f, ',');
+        fmt_u64(f, len);
+        fmt_char(f, ',');
+        fmt_u64(f, ntohs(h->ip.id));
+        fmt_char(f, ',');
+        fmt_ipv4(f, h->ip.saddr);
+        fmt_char(f, ',');
+        fmt_u64(f, ports ? ntohs(h->udp.source) : 0);
+        fmt_char(f, ',');
+        fmt_ipv4(f, h->ip.daddr);
+        fmt_char(f, ',');
+        fmt_u64(f, ports ? ntohs(h->udp.dest) : 0);
+        fmt_char(f, '\n');
+        break;
+    case FMT_BIN:
+        b.idx = idx;
+        b.saddr = h->ip.saddr;
+        b.daddr = h->ip.daddr;
+        b.cpu = c - cpu;
+        b.len = len;
+        b.id = ntohs(h->ip.id);
+        b.sport = ports ? ntohs(h->udp.source) : 0;
+        b.dport = ports ? ntohs(h->udp.dest) : 0;
+        b.proto = h->ip.protocol;
+        fmt_mem(f, &b, sizeof(b));
+        break;
+    }
+}
 
 void
 pkt_save(struct cpu_t *c) {
-    int len = ntohs(c->ip.tot_len) + ETH_HLEN;
-    char dst[INET6_ADDRSTRLEN], src[INET6_ADDRSTRLEN],
-        dst_port[INET6_ADDRSTRLEN+8], src_port[INET6_ADDRSTRLEN+8];
+    struct hdr_t *h = (struct hdr_t*)slot[c->chunk[0]].data;
+    int len = ntohs(h->ip.tot_len) + ETH_HLEN;
+    struct pcap_flow f = {0};
+    struct timeval t;
+    int i = shards ? c - cpu : NCPU;
 
     if (len != c->size) {
         LOGERR("Invalid packet size: %d/%d\n", len, c->size);
+        pkt_release(c);
         return;
     }
 
-    eth_ip_addr(dst, src, &c->eth);
-    if (c->ip.protocol == IPPROTO_TCP || c->ip.protocol == IPPROTO_UDP) {
-        snprintf(src_port, sizeof(src_port), "%s:%d",
-            src, ntohs(c->udp.source));
-        snprintf(dst_port, sizeof(dst_port), "%s:%d",
-            dst, ntohs(c->udp.dest));
-    } else {
-        snprintf(src_port, sizeof(src_port), "%s", src);
-        snprintf(dst_port, sizeof(dst_port), "%s", dst);
+    TRY(!fmt_reserve(&out),);
+    pkt_fmt(&out, c, h, len);
+    idx++;
+
+    if (!ring.p) {
+        f.saddr = h->ip.saddr;
+        f.daddr = h->ip.daddr;
+        f.proto = h->ip.protocol;
+        if (f.proto == IPPROTO_TCP || f.proto == IPPROTO_UDP) {
+            f.sport = h->udp.source;
+            f.dport = h->udp.dest;
+        }
+        gettimeofday(&t, NULL);
+        if (out_open(i)) {
+            pkt_release(c);
+            return;
+        }
+        TRY(!pcap_index_add(&pidx[i], &t, &f, len),);
+        TRY(!pkt_write(i, c, &t),);
+        return;
+    }
+    // h lives in the first slot, done with it before the release
+    if ((h->ip.protocol == IPPROTO_TCP || h->ip.protocol == IPPROTO_UDP) &&
+        (ntohs(h->udp.source) == port || ntohs(h->udp.dest) == port)) {
+        if (dump || !ring_armed())
+            ring.skipped++;
+        else
+            dump = 2;
     }
+    ring_push(c);
+    pkt_release(c);
+}
 
-    LOG("[%05d/%02d] %5s %5d %5d %21s > %-21s\n", idx, (int)(c-cpu),
-        ip_proto_name(c->ip.protocol),
-        len, ntohs(c->ip.id), src_port, dst_port);
-    TRY(!pcap_write(pcap, c->data, c->size),);
-    idx++;
+void
+usage(char *name) {
+    LOG("usage: %s [-r MB] [-t seconds] [-H] [-d drops] [-m port] [-S] [-u] "
+        "[-l seconds] [-o text|csv|bin] [-w file]\n", name);
 }
 
 int
-main(void) {
-    int sock = -1, map = -1, prog = -1, ret = 0;
-    struct __packed {
-        uint8_t data[500];
-        uint32_t head, size, cpu;
-    } pkt;
+main(int argc, char **argv) {
+    struct sigaction sa = {.sa_handler = sigusr1_handler};
+    int sock = -1, map = -1, drops = -1, prog = -1, ret = 0, huge = 0,
+        mode = FMT_TEXT, fd = STDOUT_FILENO, popped, o;
+    uint64_t ndrop = 0, last = 0, threshold = 0;
+    long interval = 0, now, shown = get_time(), synced = shown;
+    uint32_t zero = 0;
+    size_t size = 0;
+    struct pkt_t *pkt;
     struct cpu_t *c;
+    uint32_t s;
+
+    while ((o = getopt(argc, argv, "r:t:Hd:m:Sul:o:w:h")) != -1) {
+        switch (o) {
+        case 'r': size = atol(optarg) * MB; break;
+        case 't': ring.window = atol(optarg) * 1000000L; break;
+        case 'H': huge = 1; break;
+        case 'd': threshold = atol(optarg); break;
+        case 'm': port = atoi(optarg); break;
+        case 'S': shards = 1; break;
+        case 'u': uring = 1; break;
+        case 'l': interval = atol(optarg) * SECOND; break;
+        case 'o':
+            if ((mode = fmt_mode(optarg)) >= 0)
+                break;
+            __fallthrough;
+        default: usage(argv[0]); return EINVAL;
+        case 'w':
+            TRY((fd = open(optarg, O_WRONLY|O_CREAT|O_TRUNC, 0644)) != -1,
+                return errno);
+            break;
+        }
+    }
+
+    for (s = 0; s < NSLOT; s++)
+        slot_put(s);
 
     bpf_init();
+    sigemptyset(&sa.sa_mask);
+    ASSERT(!sigaction(SIGUSR1, &sa, NULL));
+
     TRY(!(ret = bpf_map_create(&map, BPF_MAP_TYPE_QUEUE, 0,
-        sizeof(pkt), MB)), goto err);
+        sizeof(*pkt), MB)), goto err);
+    TRY(!(ret = bpf_map_create(&drops, BPF_MAP_TYPE_ARRAY, 4, 8, 1)),
+        goto err);
 
-    TRY(!(ret = pcap_open(&pcap, "ipdump.pcap")), goto err);
+    if (size || ring.window) {
+        // 2MB multiple so it can be hugepage backed
+        size = ((size ? size : 64 * MB) + 2 * MB - 1) & ~(2 * MB - 1);
+        TRY(!(ret = ring_init(size, huge)), goto err);
+        LOG("recording %lu MB %ld s\n", size / MB, ring.window / 1000000L);
+    } else if (!shards) {
+        TRY(!(ret = out_open(NCPU)), goto err);
+    }
 
     struct bpf_insn insns[] = {
         bpf_mov8(bpf_r9, bpf_r1),
@@ -78,6 +515,8 @@ main(void) {
 
         bpf_call(get_smp_processor_id),
         bpf_mov8(bpf_r6, bpf_r0),
+        bpf_call(ktime_get_ns),
+        bpf_st8(bpf_fp, -sizeof(*pkt), bpf_r0),
 
         bpf_skb_load(-2, ip_len_off, 2, -1),
         bpf_ld2(bpf_r8, bpf_fp, -2),
@@ -88,21 +527,21 @@ main(void) {
 
         bpf_mov8i(bpf_r7, 0),
         bpf_st4(bpf_fp, -4, bpf_r6),
-        bpf_st4i(bpf_fp, -8, sizeof(pkt.data)),
+        bpf_st4i(bpf_fp, -8, CHUNK),
         bpf_st4i(bpf_fp, -12, 1),
 
-        bpf_jslt8i(bpf_r8, sizeof(pkt.data), 22),
+        bpf_jslt8i(bpf_r8, CHUNK, 33),
         bpf_mov8(bpf_r1, bpf_r9),
         bpf_mov8(bpf_r2, bpf_r7),
         bpf_mov8(bpf_r3, bpf_fp),
-        bpf_add8i(bpf_r3, -sizeof(pkt)),
-        bpf_mov8i(bpf_r4, sizeof(pkt.data)),
+        bpf_add8i(bpf_r3, -sizeof(*pkt) + offsetof(struct pkt_t, data)),
+        bpf_mov8i(bpf_r4, CHUNK),
         bpf_ret_call(skb_load_bytes, 0, -1), // 4 ins
-        bpf_map_push(map, -sizeof(pkt), -1), // 9 ins
-        bpf_add8i(bpf_r8, -sizeof(pkt.data)),
-        bpf_add8i(bpf_r7, sizeof(pkt.data)),
+        bpf_map_push_drop(map, -sizeof(*pkt), drops, -1), // 20 ins
+        bpf_add8i(bpf_r8, -CHUNK),
+        bpf_add8i(bpf_r7, CHUNK),
         bpf_st4i(bpf_fp, -12, 0),
-        bpf_jsge8i(bpf_r8, sizeof(pkt.data), -22),
+        bpf_jsge8i(bpf_r8, CHUNK, -33),
 
         bpf_jsgt8i(bpf_r8, 0, 2),
         bpf_return(-1),
@@ -112,10 +551,10 @@ main(void) {
         bpf_mov8(bpf_r1, bpf_r9),
         bpf_mov8(bpf_r2, bpf_r7),
         bpf_mov8(bpf_r3, bpf_fp),
-        bpf_add8i(bpf_r3, -sizeof(pkt)),
+        bpf_add8i(bpf_r3, -sizeof(*pkt) + offsetof(struct pkt_t, data)),
         bpf_mov8(bpf_r4, bpf_r8),
         bpf_ret_call(skb_load_bytes, 0, -1),
-        bpf_map_push(map, -sizeof(pkt), -1),
+        bpf_map_push_drop(map, -sizeof(*pkt), drops, -1),
         bpf_return(-1),
     };
 
@@ -126,33 +565,85 @@ main(void) {
 
     TRY(!(ret = if_attach(&sock, IFACE, prog)), goto err);
 
+    fmt_init(&out, fd, mode);
+    if (mode == FMT_CSV)
+        fmt_str(&out, "idx,cpu,proto,len,id,src,sport,dst,dport\n");
+
     while (bpf_is_running()) {
         TINYSLEEP();
 
-        ret = bpf_map_pop(map, &pkt);
-        if (ret == ENOENT) {
-            ret = 0;
-            continue;
-        }
-        TRY(!ret, goto err);
+        for (popped = 0;; popped++) {
+            TRY(!(ret = slot_get(&s)), goto err);
+            pkt = &slot[s];
+            if ((ret = bpf_map_pop(map, pkt))) {
+                slot_put(s);
+                break;
+            }
+            TRY(pkt->cpu < NCPU && pkt->size <= CHUNK, RETURN(EINVAL, err));
+            c = &cpu[pkt->cpu];
+            if (pkt->head)
+                lat_add(&lat[pkt->cpu], get_time() - pkt->ns);
 
-        TRY(pkt.cpu < NCPU, RETURN(EINVAL, err));
-        c = &cpu[pkt.cpu];
-
-        if (pkt.head) {
-            if (c->size) pkt_save(c);
-            c->size = 0;
+            if (pkt->head && c->n)
+                pkt_save(c);
+            // longer than any IPv4 packet, fails the size check
+            if (c->n == LEN(c->chunk)) {
+                c->size += pkt->size;
+                slot_put(s);
+                continue;
+            }
+            c->chunk[c->n++] = s;
+            c->size += pkt->size;
+        }
+        TRY(ret == ENOENT, goto err);
+        TRY(!(ret = batch_flush_all()), goto err);
+        if (uring && (!popped || get_time() - synced >= SECOND)) {
+            for (o = 0; o <= NCPU; o++)
+                TRY(!(ret = pcap_sink_flush(&psink[o])), goto err);
+            synced = get_time();
+        }
+        TRY(!(ret = fmt_flush(&out)), goto err);
+        if (interval && (now = get_time()) - shown >= interval) {
+            lat_print(lat, NCPU);
+            shown = now;
         }
 
-        memcpy(c->data + c->size, pkt.data, pkt.size);
-        c->size += pkt.size;
-
+        TRY(!(ret = bpf_map_lookup(drops, &zero, &ndrop)), goto err);
+        if (!ring.p)
+            continue;
+        if (threshold && ndrop - last >= threshold) {
+            last = ndrop;
+            TRY(!(ret = ring_dump("drops")), goto err);
+        }
+        if (dump) {
+            TRY(!(ret = ring_dump(dump == 1 ? "signal" : "port")),
+                goto err);
+            dump = 0;
+        }
     }
 
+    // last packet of each cpu has no following head to complete it
+    for (c = cpu; c < cpu + NCPU; c++)
+        if (c->n) pkt_save(c);
+    TRY(!(ret = batch_flush_all()), goto err);
+    for (o = 0; o <= NCPU; o++)
+        TRY(!(ret = pcap_sink_close(&psink[o])), goto err);
+    TRY(!(ret = fmt_flush(&out)), goto err);
+    lat_print(lat, NCPU);
+    LOG("packets %d drops %lu\n", idx, ndrop);
+
 err:
-    if (pcap > 0) close(pcap);
+    if (fd != STDOUT_FILENO) close(fd);
+    for (o = 0; o <= NCPU; o++) {
+        if (pfd[o] > 0) close(pfd[o]);
+        pcap_sink_close(&psink[o]);
+    }
+    for (o = 0; o <= NCPU; o++)
+        if (pidx[o].fd > 0) pcap_index_close(&pidx[o]);
     if (sock > 0) close(sock);
     if (map > 0) close(map);
+    if (drops > 0) close(drops);
+    if (ring.p && ring.p != MAP_FAILED) munmap(ring.p, ring.size);
     if (prog > 0) close(prog);
     if (ret) LOGERR("%s\n", strerror(ret));
     return ret;
@@ -1,25 +1,53 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/if_packet.h>
+
 #include "bpf.h"
+#include "fmt.h"
 #include "config.h"
 #include "../tools.h"
 
-int
-main(void) {
-    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
-    int sock = -1, map = -1, prog = -1, ret = 0, t;
-    struct __packed {
-        struct ethhdr eth;
-        union __packed {
-            struct iphdr ipv4;
-            struct ipv6hdr ipv6;
-        };
-    } hdr;
+// ns: CLOCK_MONOTONIC when the program saw the packet, as get_time()
+struct __packed hdr_t {
+    uint64_t ns;
+    struct ethhdr eth;
+    union __packed {
+        struct iphdr ipv4;
+        struct ipv6hdr ipv6;
+    };
+    uint16_t cpu; // also pads the record to an aligned stack slot
+};
 
-    bpf_init();
-    TRY(!(ret = bpf_map_create(&map, BPF_MAP_TYPE_QUEUE, 0,
-        sizeof(hdr), MB)), goto err);
+/*
+  -F n opens n sockets in one PACKET_FANOUT group (-M hash, cpu or bpf, a
+  symmetric 5-tuple hash so both directions of a flow stay together), each
+  with its own map, program, worker thread and <file>.<n> output. Every
+  map holds -q records, 1M by default, so a busy socket can't starve
+*/
+
+#define NWORKER 64
+
+struct worker_t {
+    pthread_t tid;
+    int sock, map, prog, fd, ret;
+    long n;
+    struct fmt out;
+    struct lat_hist lat[NCPU];
+} *worker;
 
+int nworker = 1, mode = FMT_TEXT;
+volatile int failed = 0;
+struct lat_hist lat[NCPU]; // workers merged
+
+int
+hdr_prog(int *prog, int map, int print) {
+    struct hdr_t hdr;
     struct bpf_insn insns[] = {
         bpf_mov8(bpf_r9, bpf_r1),
+        bpf_call(ktime_get_ns),
+        bpf_st8(bpf_fp, -sizeof(hdr), bpf_r0),
 
         bpf_skb_load(-2, eth_proto_off, 2, -1),
         bpf_ld2(bpf_r8, bpf_fp, -2),
@@ -29,54 +57,252 @@ main(void) {
         bpf_return(-1),
 
         bpf_jeq8i(bpf_r8, ETH_P_IPV6, 6),
-        bpf_stack_zero8((sizeof(hdr) - ETH_HLEN - sizeof(hdr.ipv4)) / 8 + 1),
+        bpf_stack_zero8((sizeof(hdr) - offsetof(struct hdr_t, ipv4) -
+            sizeof(hdr.ipv4)) / 8 + 1),
 
         bpf_mov8(bpf_r1, bpf_r9),
         bpf_mov8i(bpf_r2, 0),
         bpf_mov8(bpf_r3, bpf_fp),
-        bpf_add8i(bpf_r3, -sizeof(hdr)),
+        bpf_add8i(bpf_r3, -sizeof(hdr) + offsetof(struct hdr_t, eth)),
         bpf_mov8i(bpf_r4, ETH_HLEN + sizeof(hdr.ipv4)),
         bpf_jeq8i(bpf_r8, ETH_P_IP, 1),
         bpf_mov8i(bpf_r4, ETH_HLEN + sizeof(hdr.ipv6)),
         bpf_ret_call(skb_load_bytes, 0, -1),
+        bpf_call(get_smp_processor_id),
+        bpf_st2(bpf_fp, -2, bpf_r0),
 
         bpf_map_push(map, -sizeof(hdr), -1),
         bpf_return(-1),
     };
 
-    bpf_print(insns, LEN(insns));
+    if (print)
+        bpf_print(insns, LEN(insns));
+    return bpf_prog_load(prog, BPF_PROG_TYPE_SOCKET_FILTER, insns,
+        LEN(insns), "MIT", 10 * MB);
+}
+
+// PACKET_FANOUT_EBPF: socket index from a hash of the IPv4/IPv6 addresses
+// and TCP/UDP ports, xored so that both directions agree. Fragments hash
+// on the addresses alone, their ports are only in the first one. Other
+// frames go to 0
+int
+fanout_prog(int *prog, int n) {
+    struct bpf_insn insns[] = {
+        bpf_mov8(bpf_r9, bpf_r1),
+        bpf_mov8i(bpf_r6, 0),
+
+        bpf_skb_load(-2, eth_proto_off, 2, 0),
+        bpf_ld2(bpf_r1, bpf_fp, -2),
+        bpf_be2(bpf_r1),
+        bpf_jeq8i(bpf_r1, ETH_P_IPV6, 24),
+        bpf_jne8i(bpf_r1, ETH_P_IP, 61),
+
+        bpf_skb_load(-24, ETH_HLEN, sizeof(struct iphdr), 0), // 9 ins
+        bpf_ld4(bpf_r6, bpf_fp, -24 + offsetof(struct iphdr, saddr)),
+        bpf_ld4(bpf_r1, bpf_fp, -24 + offsetof(struct iphdr, daddr)),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld2(bpf_r1, bpf_fp, -24 + offsetof(struct iphdr, frag_off)),
+        bpf_be2(bpf_r1),
+        bpf_jset8i(bpf_r1, 0x3fff, 46), // MF or a fragment offset
+        bpf_ld1(bpf_r1, bpf_fp, -24 + offsetof(struct iphdr, protocol)),
+        bpf_jeq8i(bpf_r1, IPPROTO_TCP, 1),
+        bpf_jne8i(bpf_r1, IPPROTO_UDP, 43),
+        // ports right after the ihl * 4 byte header
+        bpf_ld1(bpf_r2, bpf_fp, -24),
+        bpf_and8i(bpf_r2, 0xf),
+        bpf_lsh8i(bpf_r2, 2),
+        bpf_add8i(bpf_r2, ETH_HLEN),
+        bpf_ja(28),
+
+        // all 8 address words, ports only without extension headers
+        bpf_skb_load(-40, ETH_HLEN, sizeof(struct ipv6hdr), 0), // 9 ins
+        bpf_ld4(bpf_r6, bpf_fp, -32),
+        bpf_ld4(bpf_r1, bpf_fp, -28),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -24),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -20),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -16),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -12),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -8),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, -4),
+        bpf_xor8(bpf_r6, bpf_r1),
+        bpf_ld1(bpf_r1, bpf_fp, -40 + offsetof(struct ipv6hdr, nexthdr)),
+        bpf_jeq8i(bpf_r1, IPPROTO_TCP, 1),
+        bpf_jne8i(bpf_r1, IPPROTO_UDP, 11),
+        bpf_mov8i(bpf_r2, ETH_HLEN + sizeof(struct ipv6hdr)),
+
+        // r2: offset of the ports
+        bpf_mov8(bpf_r1, bpf_r9),
+        bpf_mov8(bpf_r3, bpf_fp),
+        bpf_add8i(bpf_r3, -44),
+        bpf_mov8i(bpf_r4, 4),
+        bpf_call(skb_load_bytes),
+        bpf_jne8i(bpf_r0, 0, 4),
+        bpf_ld2(bpf_r1, bpf_fp, -44),
+        bpf_ld2(bpf_r2, bpf_fp, -42),
+        bpf_xor8(bpf_r1, bpf_r2),
+        bpf_xor8(bpf_r6, bpf_r1),
+
+        // multiplicative hash, high half
+        bpf_mul4i(bpf_r6, 0x9e3779b1),
+        bpf_rsh4i(bpf_r6, 16),
+        bpf_mod4i(bpf_r6, n),
+        bpf_mov8(bpf_r0, bpf_r6),
+        bpf_exit(),
+    };
+
+    return bpf_prog_load(prog, BPF_PROG_TYPE_SOCKET_FILTER, insns,
+        LEN(insns), "MIT", 0);
+}
 
-    TRY(!(ret = bpf_prog_load(&prog, BPF_PROG_TYPE_SOCKET_FILTER, insns,
-        LEN(insns), "MIT", 10 * MB)), goto err);
+void*
+worker_run(void *arg) {
+    struct worker_t *w = arg;
+    struct hdr_t hdr;
+    int ret = 0, t;
 
-    TRY(!(ret = if_attach(&sock, IFACE, prog)), goto err);
+    fmt_init(&w->out, w->fd, mode);
+    if (mode == FMT_CSV)
+        fmt_str(&w->out, "eth,proto,len,id,src,dst\n");
 
-    while (bpf_is_running()) {
+    while (bpf_is_running() && !failed) {
         TINYSLEEP();
 
-        ret = bpf_map_pop(map, &hdr);
-        if (ret == ENOENT) {
-            ret = 0;
-            continue;
+        while (!(ret = bpf_map_pop(w->map, &hdr))) {
+            t = ntohs(hdr.eth.h_proto);
+            ASSERT(t == ETH_P_IP || t == ETH_P_IPV6);
+            TRY(hdr.cpu < NCPU, RETURN(EINVAL, err));
+            lat_add(&w->lat[hdr.cpu], get_time() - hdr.ns);
+
+            TRY(!(ret = fmt_reserve(&w->out)), goto err);
+            fmt_eth_hdr(&w->out, &hdr.eth);
+            w->n++;
         }
-        TRY(!ret, goto err);
+        TRY(ret == ENOENT, goto err);
+        TRY(!(ret = fmt_flush(&w->out)), goto err);
+    }
+
+err:
+    TRY(!fmt_flush(&w->out),);
+    if (ret)
+        failed = 1;
+    w->ret = ret;
+    return NULL;
+}
+
+// while the workers run this reads counters they are updating, good enough
+// for the periodic lines, exact once they are joined
+void
+lat_collect(void) {
+    int i, c;
+
+    ZERO(lat);
+    for (i = 0; i < nworker; i++)
+        for (c = 0; c < NCPU; c++)
+            lat_merge(&lat[c], &worker[i].lat[c]);
+}
 
-        t = ntohs(hdr.eth.h_proto);
-        ASSERT(t == ETH_P_IP || t == ETH_P_IPV6);
+void
+usage(char *name) {
+    LOG("usage: %s [-F sockets] [-M hash|cpu|bpf] [-q records] "
+        "[-l seconds] [-o text|csv|bin] [-w file]\n", name);
+}
 
-        eth_ip_addr(src, dst, &hdr.eth);
+int
+main(int argc, char **argv) {
+    int ret = 0, group = getpid() & 0xffff, fanout = PACKET_FANOUT_HASH,
+        fprog = -1, o, i;
+    long n = 0, interval = 0, queue = MB, now, shown = get_time();
+    char *file = NULL, fn[PATH_MAX];
+    struct worker_t *w;
 
-        LOG("%5s %5s %5d %5d %15s > %-15s\n",
-            eth_proto_name(hdr.eth.h_proto),
-            t == ETH_P_IP ? ip_proto_name(hdr.ipv4.protocol) : "",
-            ntohs(t == ETH_P_IP ? hdr.ipv4.tot_len : hdr.ipv6.payload_len),
-            t == ETH_P_IP ? ntohs(hdr.ipv4.id) : -1, src, dst);
+    while ((o = getopt(argc, argv, "F:M:q:l:o:w:h")) != -1) {
+        switch (o) {
+        case 'F': nworker = atoi(optarg); break;
+        case 'M':
+            if (!strcmp(optarg, "hash")) fanout = PACKET_FANOUT_HASH;
+            else if (!strcmp(optarg, "cpu")) fanout = PACKET_FANOUT_CPU;
+            else if (!strcmp(optarg, "bpf")) fanout = PACKET_FANOUT_EBPF;
+            else nworker = 0;
+            break;
+        case 'q': queue = atol(optarg); break;
+        case 'l': interval = atol(optarg) * SECOND; break;
+        case 'o':
+            if ((mode = fmt_mode(optarg)) >= 0)
+                break;
+            __fallthrough;
+        default: usage(argv[0]); return EINVAL;
+        case 'w': file = optarg; break;
+        }
+    }
+    if (nworker < 1 || nworker > NWORKER || queue < 1 ||
+        queue > UINT32_MAX) {
+        usage(argv[0]);
+        return EINVAL;
     }
 
+    bpf_init();
+    ASSERT(worker = calloc(nworker, sizeof(*worker)));
+    if (nworker > 1 && fanout == PACKET_FANOUT_EBPF)
+        TRY(!(ret = fanout_prog(&fprog, nworker)), goto err);
+
+    for (i = 0; i < nworker; i++) {
+        w = &worker[i];
+        w->fd = STDOUT_FILENO;
+        if (nworker > 1)
+            snprintf(fn, sizeof(fn), "%s.%d", file ? file : "iphdr", i);
+        if (nworker > 1 || file)
+            TRY((w->fd = open(nworker > 1 ? fn : file,
+                O_WRONLY|O_CREAT|O_TRUNC, 0644)) != -1, RETURN(errno, err));
+
+        TRY(!(ret = bpf_map_create(&w->map, BPF_MAP_TYPE_QUEUE, 0,
+            sizeof(struct hdr_t), queue)), goto err);
+        TRY(!(ret = hdr_prog(&w->prog, w->map, !i)), goto err);
+        if (nworker > 1)
+            TRY(!(ret = if_attach_fanout(&w->sock, IFACE, w->prog, group,
+                fanout, fprog)), goto err);
+        else
+            TRY(!(ret = if_attach(&w->sock, IFACE, w->prog)), goto err);
+    }
+
+    for (i = 0; i < nworker; i++)
+        ASSERT(!pthread_create(&worker[i].tid, NULL, worker_run, &worker[i]));
+    while (bpf_is_running() && !failed) {
+        TINYSLEEP();
+        if (interval && (now = get_time()) - shown >= interval) {
+            lat_collect();
+            lat_print(lat, NCPU);
+            shown = now;
+        }
+    }
+    for (i = 0; i < nworker; i++) {
+        ASSERT(!pthread_join(worker[i].tid, NULL));
+        if (!ret)
+            ret = worker[i].ret;
+        n += worker[i].n;
+    }
+
+    lat_collect();
+    lat_print(lat, NCPU);
+    for (i = 0; nworker > 1 && i < nworker; i++)
+        LOG("socket %d packets %ld\n", i, worker[i].n);
+    LOG("packets %ld\n", n);
+
 err:
-    if (sock > 0) close(sock);
-    if (map > 0) close(map);
-    if (prog > 0) close(prog);
+    for (i = 0; worker && i < nworker; i++) {
+        w = &worker[i];
+        if (w->fd > 0 && w->fd != STDOUT_FILENO) close(w->fd);
+        if (w->sock > 0) close(w->sock);
+        if (w->map > 0) close(w->map);
+        if (w->prog > 0) close(w->prog);
+    }
+    if (fprog > 0) close(fprog);
+    free(worker);
     if (ret) LOGERR("%s\n", strerror(ret));
     return ret;
 }
@@ -0,0 +1,203 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bpf.h"
+#include "../tools.h"
+
+/*
+  k-way merge of pcap files (e.g. ipdump -S shards) by timestamp: inputs
+  are mmapped and a min-heap keyed on each input's next record picks the
+  one to copy, records are copied verbatim into a large output buffer
+*/
+
+#define PCAP_HLEN 24
+#define REC_HLEN 16
+#define OUT_BUF (4 * MB)
+
+struct src_t {
+    char *name;
+    uint8_t *p;
+    size_t size, off;
+    uint64_t ts; // usec of the record at off
+    uint32_t snaplen, linktype;
+    int nsec;
+};
+
+struct src_t *src;
+int *heap, nheap = 0;
+
+uint8_t out[OUT_BUF];
+size_t nout = 0;
+
+// false once the input is exhausted or truncated
+int
+src_next(struct src_t *s) {
+    uint32_t *h = (uint32_t*)(s->p + s->off);
+
+    if (s->size - s->off < REC_HLEN)
+        return 0;
+    if (s->size - s->off - REC_HLEN < le32toh(h[2])) {
+        LOGERR("%s: truncated record at %lu\n", s->name, s->off);
+        return 0;
+    }
+    s->ts = le32toh(h[0]) * 1000000UL +
+        (s->nsec ? le32toh(h[1]) / 1000 : le32toh(h[1]));
+    return 1;
+}
+
+int
+src_open(struct src_t *s, char *name) {
+    struct stat st;
+    uint32_t magic;
+    int fd, ret = 0;
+
+    s->name = name;
+    s->p = MAP_FAILED;
+    TRY((fd = open(name, O_RDONLY)) != -1, return errno);
+    TRY(!fstat(fd, &st), RETURN(errno, err));
+    TRYF(st.st_size >= PCAP_HLEN, RETURN(EINVAL, err), " %s\n", name);
+    s->size = st.st_size;
+    TRY((s->p = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0))
+        != MAP_FAILED, RETURN(errno, err));
+    madvise(s->p, s->size, MADV_SEQUENTIAL);
+
+    // little-endian, microsecond or nanosecond
+    magic = le32toh(*(uint32_t*)s->p);
+    TRYF(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d, RETURN(EINVAL, err),
+        " %s: magic %x\n", name, magic);
+    s->nsec = magic == 0xa1b23c4d;
+    s->snaplen = le32toh(((uint32_t*)s->p)[4]);
+    s->linktype = le32toh(((uint32_t*)s->p)[5]);
+    s->off = PCAP_HLEN;
+
+err:
+    close(fd);
+    return ret;
+}
+
+int
+heap_less(int a, int b) {
+    return src[heap[a]].ts < src[heap[b]].ts ||
+        (src[heap[a]].ts == src[heap[b]].ts && heap[a] < heap[b]);
+}
+
+void
+heap_swap(int a, int b) {
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+}
+
+void
+heap_down(int i) {
+    int m, l;
+
+    for (;; i = m) {
+        m = i;
+        l = 2 * i + 1;
+        if (l < nheap && heap_less(l, m)) m = l;
+        if (l + 1 < nheap && heap_less(l + 1, m)) m = l + 1;
+        if (m == i) return;
+        heap_swap(i, m);
+    }
+}
+
+void
+heap_up(int i) {
+    for (; i && heap_less(i, (i - 1) / 2); i = (i - 1) / 2)
+        heap_swap(i, (i - 1) / 2);
+}
+
+int
+out_write(int fd, void *p, size_t size) {
+    int ret = 0;
+
+    if (nout + size > sizeof(out)) {
+        TRY(!(ret = file_write(fd, out, nout)), return ret);
+        nout = 0;
+    }
+    // records larger than the buffer go straight out
+    if (size > sizeof(out))
+        return file_write(fd, p, size);
+    memcpy(out + nout, p, size);
+    nout += size;
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    int fd = -1, ret = 0, n = argc - 2, i;
+    struct src_t *s;
+    uint64_t recs = 0, last = 0, reordered = 0;
+    uint32_t h[PCAP_HLEN / 4], snaplen = 0;
+    size_t len;
+
+    if (argc < 3) {
+        LOG("usage: %s <out.pcap> <in.pcap>...\n", argv[0]);
+        return EINVAL;
+    }
+
+    ASSERT(src = calloc(n, sizeof(*src)));
+    ASSERT(heap = calloc(n, sizeof(*heap)));
+    for (i = 0; i < n; i++)
+        src[i].p = MAP_FAILED;
+
+    for (i = 0; i < n; i++) {
+        TRY(!(ret = src_open(&src[i], argv[i + 2])), goto err);
+        // records are copied verbatim, they must share a link layer
+        TRYF(src[i].linktype == src[0].linktype, RETURN(EINVAL, err),
+            " %s: linktype %u, %s has %u\n", src[i].name, src[i].linktype,
+            src[0].name, src[0].linktype);
+        if (src[i].snaplen > snaplen)
+            snaplen = src[i].snaplen;
+        if (!src_next(&src[i]))
+            continue;
+        heap[nheap++] = i;
+        heap_up(nheap - 1);
+    }
+
+    // the first input's header, microsecond and with the largest snaplen
+    TRY((fd = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644)) > 0,
+        RETURN(errno, err));
+    memcpy(h, src[0].p, PCAP_HLEN);
+    h[0] = htole32(0xa1b2c3d4);
+    h[4] = htole32(snaplen);
+    TRY(!(ret = out_write(fd, h, PCAP_HLEN)), goto err);
+
+    while (nheap) {
+        s = &src[heap[0]];
+        len = REC_HLEN + le32toh(((uint32_t*)(s->p + s->off))[2]);
+        if (s->nsec) {
+            // rewrite the header to the microsecond output format
+            memcpy(h, s->p + s->off, REC_HLEN);
+            h[1] = htole32(le32toh(h[1]) / 1000);
+            TRY(!(ret = out_write(fd, h, REC_HLEN)), goto err);
+            TRY(!(ret = out_write(fd, s->p + s->off + REC_HLEN,
+                len - REC_HLEN)), goto err);
+        } else {
+            TRY(!(ret = out_write(fd, s->p + s->off, len)), goto err);
+        }
+        // inputs are assumed sorted, count where they are not
+        reordered += s->ts < last;
+        last = s->ts;
+        recs++;
+
+        s->off += len;
+        if (!src_next(s))
+            heap[0] = heap[--nheap];
+        heap_down(0);
+    }
+    TRY(!(ret = file_write(fd, out, nout)), goto err);
+    LOG("merged %lu records from %d files, %lu out of order\n", recs, n,
+        reordered);
+
+err:
+    for (i = 0; i < n; i++)
+        if (src[i].p != MAP_FAILED) munmap(src[i].p, src[i].size);
+    free(src);
+    free(heap);
+    if (fd > 0) close(fd);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
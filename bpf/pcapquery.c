@@ -0,0 +1,178 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bpf.h"
+#include "../tools.h"
+
+/*
+  copy the records of a time range and/or one flow (either direction) from
+  a pcap to a new pcap, only reading the buckets of <in>.idx whose time
+  range overlaps and whose bloom filter may hold the flow. -L scans the
+  whole file instead, for comparison
+*/
+
+#define PCAP_HLEN 24
+#define REC_HLEN 16
+
+struct file_t {
+    uint8_t *p;
+    size_t size;
+};
+
+int
+file_map(struct file_t *f, char *name) {
+    struct stat st;
+    int fd, ret = 0;
+
+    f->p = MAP_FAILED;
+    TRYF((fd = open(name, O_RDONLY)) != -1, return errno, " %s\n", name);
+    TRY(!fstat(fd, &st), RETURN(errno, err));
+    f->size = st.st_size;
+    TRY((f->p = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0))
+        != MAP_FAILED, RETURN(errno, err));
+err:
+    close(fd);
+    return ret;
+}
+
+// proto,saddr:sport,daddr:dport
+int
+flow_parse(struct pcap_flow *f, char *s) {
+    char *tok[3], *port;
+    struct in_addr a;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        TRY(tok[i] = strtok(i ? NULL : s, ","), return EINVAL);
+    if (!strcmp(tok[0], "tcp")) f->proto = IPPROTO_TCP;
+    else if (!strcmp(tok[0], "udp")) f->proto = IPPROTO_UDP;
+    else f->proto = atoi(tok[0]);
+
+    for (i = 1; i < 3; i++) {
+        if ((port = strchr(tok[i], ':')))
+            *port++ = 0;
+        TRYF(inet_pton(AF_INET, tok[i], &a) == 1, return EINVAL, " %s\n",
+            tok[i]);
+        *(i == 1 ? &f->saddr : &f->daddr) = a.s_addr;
+        *(i == 1 ? &f->sport : &f->dport) = htons(port ? atoi(port) : 0);
+    }
+    return 0;
+}
+
+int
+flow_match(struct pcap_flow *f, uint8_t *p, uint32_t size) {
+    struct ethhdr *eth = (struct ethhdr*)p;
+    struct iphdr *ip = (struct iphdr*)(p + ETH_HLEN);
+    uint16_t *port;
+
+    if (size < ETH_HLEN + sizeof(*ip) || eth->h_proto != htons(ETH_P_IP) ||
+        ip->protocol != f->proto)
+        return 0;
+    if (f->proto != IPPROTO_TCP && f->proto != IPPROTO_UDP)
+        return (ip->saddr == f->saddr && ip->daddr == f->daddr) ||
+            (ip->saddr == f->daddr && ip->daddr == f->saddr);
+
+    if (size < ETH_HLEN + ip->ihl * 4U + 4)
+        return 0;
+    port = (uint16_t*)(p + ETH_HLEN + ip->ihl * 4);
+    return (ip->saddr == f->saddr && ip->daddr == f->daddr &&
+            port[0] == f->sport && port[1] == f->dport) ||
+        (ip->saddr == f->daddr && ip->daddr == f->saddr &&
+            port[0] == f->dport && port[1] == f->sport);
+}
+
+int
+main(int argc, char **argv) {
+    struct file_t in = {MAP_FAILED, 0}, idx = {MAP_FAILED, 0};
+    uint64_t from = 0, to = UINT64_MAX, usec, records = 0, matched = 0;
+    int out = -1, ret = 0, flow = 0, linear = 0, nsec, o, n, i, scanned = 0;
+    struct pcap_index_hdr *h;
+    struct pcap_index_ent *e;
+    struct pcap_flow f = {0};
+    size_t off, end;
+    uint32_t *r, magic, caplen;
+    struct timeval t;
+    char fn[PATH_MAX];
+    long start = get_time();
+
+    while ((o = getopt(argc, argv, "t:f:Lh")) != -1) {
+        switch (o) {
+        case 't':
+            from = strtod(optarg, &optarg) * 1000000;
+            if (*optarg == ',')
+                to = strtod(optarg + 1, NULL) * 1000000;
+            break;
+        case 'f':
+            TRY(!(ret = flow_parse(&f, optarg)), return ret);
+            flow = 1;
+            break;
+        case 'L': linear = 1; break;
+        default: optind = argc + 1;
+        }
+    }
+    if (argc - optind != 2) {
+        LOG("usage: %s [-t from[,to]] [-f proto,saddr:sport,daddr:dport] "
+            "[-L] <in.pcap> <out.pcap>\n", argv[0]);
+        return EINVAL;
+    }
+
+    TRY(!(ret = file_map(&in, argv[optind])), goto err);
+    TRY(in.size >= PCAP_HLEN, RETURN(EINVAL, err));
+    // little-endian, microsecond or nanosecond
+    magic = le32toh(*(uint32_t*)in.p);
+    TRYF(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d, RETURN(EINVAL, err),
+        " %s: magic %x\n", argv[optind], magic);
+    nsec = magic == 0xa1b23c4d;
+    if (!linear) {
+        snprintf(fn, sizeof(fn), "%s.idx", argv[optind]);
+        TRY(!(ret = file_map(&idx, fn)), goto err);
+        h = (struct pcap_index_hdr*)idx.p;
+        TRY(idx.size >= sizeof(*h) && h->magic == PCAP_INDEX_MAGIC,
+            RETURN(EINVAL, err));
+    }
+    TRY(!(ret = pcap_open(&out, argv[optind + 1])), goto err);
+
+    // one bucket over the whole file when scanning linearly
+    n = linear ? 1 : (int)((idx.size - sizeof(*h)) / sizeof(*e));
+    e = linear ? NULL : (struct pcap_index_ent*)(h + 1);
+    for (i = 0; i < n; i++) {
+        if (e) {
+            if (e[i].usec + h->bucket <= from || e[i].usec > to)
+                continue;
+            if (flow && !pcap_bloom_has(e[i].bloom, &f))
+                continue;
+        }
+        scanned++;
+        off = e ? e[i].off : PCAP_HLEN;
+        end = e && i + 1 < n ? e[i + 1].off : in.size;
+        TRY(off <= end && end <= in.size, RETURN(EINVAL, err));
+
+        for (; end - off >= REC_HLEN; off += REC_HLEN + caplen) {
+            r = (uint32_t*)(in.p + off);
+            caplen = le32toh(r[2]);
+            TRY(caplen <= end - off - REC_HLEN, RETURN(EINVAL, err));
+            records++;
+            t.tv_sec = le32toh(r[0]);
+            t.tv_usec = nsec ? le32toh(r[1]) / 1000 : le32toh(r[1]);
+            usec = t.tv_sec * 1000000UL + t.tv_usec;
+            if (usec < from || usec > to)
+                continue;
+            if (flow && !flow_match(&f, (uint8_t*)(r + 4), caplen))
+                continue;
+            TRY(!(ret = pcap_write(out, r + 4, caplen, &t)), goto err);
+            matched++;
+        }
+    }
+    LOG("buckets %d/%d records %lu matched %lu in %.3f ms\n", scanned, n,
+        records, matched, TO_MILLISECOND(get_time() - start));
+
+err:
+    if (in.p != MAP_FAILED) munmap(in.p, in.size);
+    if (idx.p != MAP_FAILED) munmap(idx.p, idx.size);
+    if (out > 0) close(out);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
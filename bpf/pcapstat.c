@@ -0,0 +1,294 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bpf.h"
+#include "../tools.h"
+
+/*
+  protocol, size and flow statistics of a pcap: the mmapped file is cut
+  into one chunk per thread, each thread finds the first record boundary
+  of its chunk and decodes into its own tables, merged at the end. names
+  and addresses are only formatted after the merge, HEXSTR is not thread
+  safe
+*/
+
+#define PCAP_HLEN 24
+#define REC_HLEN 16
+#define NTHREAD 256
+#define RESYNC 16 // chained headers that make a record boundary
+
+struct key_t {
+    uint8_t src[16], dst[16];
+    uint16_t sport, dport;
+    uint8_t proto, pad[3];
+};
+
+struct flow_t {
+    struct key_t k;
+    uint64_t pkts, bytes;
+    uint8_t *first; // record, to format the addresses from
+};
+
+struct stat_t {
+    pthread_t tid;
+    size_t off, end;
+    uint64_t pkts, bytes, eth[1 << 16], ip[256], ip_bytes[256], size[17];
+    struct flow_t *flow;
+    size_t nflow, cap;
+};
+
+struct {
+    uint8_t *p;
+    size_t size;
+    uint32_t snaplen, sec;
+} file;
+
+uint64_t
+key_hash(struct key_t *k) {
+    uint64_t h = 0xcbf29ce484222325UL;
+    uint8_t *p = (uint8_t*)k;
+    size_t i;
+
+    for (i = 0; i < sizeof(*k); i++)
+        h = (h ^ p[i]) * 0x100000001b3UL;
+    return h;
+}
+
+struct flow_t*
+flow_get(struct stat_t *s, struct key_t *k, uint8_t *rec) {
+    struct flow_t *old = s->flow, *f;
+    size_t i, n = s->cap;
+
+    // open addressing, doubled at half load
+    if (2 * (s->nflow + 1) > s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 4096;
+        ASSERT(s->flow = calloc(s->cap, sizeof(*f)));
+        s->nflow = 0;
+        for (i = 0; i < n; i++)
+            if (old[i].first)
+                *flow_get(s, &old[i].k, old[i].first) = old[i];
+        free(old);
+    }
+    for (i = key_hash(k) & (s->cap - 1);; i = (i + 1) & (s->cap - 1)) {
+        f = &s->flow[i];
+        if (!f->first) {
+            f->k = *k;
+            f->first = rec;
+            s->nflow++;
+            return f;
+        }
+        if (!memcmp(&f->k, k, sizeof(*k)))
+            return f;
+    }
+}
+
+// plausible record header chaining RESYNC times or up to the end
+int
+rec_at(size_t off, size_t end) {
+    uint32_t *r;
+    int i;
+
+    for (i = 0; i < RESYNC && off != end; i++) {
+        if (end - off < REC_HLEN)
+            return 0;
+        r = (uint32_t*)(file.p + off);
+        if (r[1] >= 1000000 || r[2] > file.snaplen || r[2] > r[3] ||
+            r[0] + 86400UL < file.sec || r[2] > end - off - REC_HLEN)
+            return 0;
+        off += REC_HLEN + r[2];
+    }
+    return 1;
+}
+
+size_t
+rec_sync(size_t off) {
+    if (off <= PCAP_HLEN)
+        return PCAP_HLEN;
+    for (; off < file.size && !rec_at(off, file.size); off++);
+    return off;
+}
+
+void
+rec_decode(struct stat_t *s, uint8_t *rec) {
+    uint32_t len = ((uint32_t*)rec)[2], size = ((uint32_t*)rec)[3];
+    struct ethhdr *eth = (struct ethhdr*)(rec + REC_HLEN);
+    uint8_t *p = (uint8_t*)(eth + 1), *l4 = NULL;
+    struct flow_t *f;
+    struct key_t k = {0};
+    int b;
+
+    s->pkts++;
+    s->bytes += size;
+    for (b = 0; b < 16 && size >> (b + 1); b++);
+    s->size[b]++;
+    if (len < ETH_HLEN)
+        return;
+    s->eth[ntohs(eth->h_proto)]++;
+
+    if (eth->h_proto == htons(ETH_P_IP) &&
+        len >= ETH_HLEN + sizeof(struct iphdr)) {
+        struct iphdr *ip = (struct iphdr*)p;
+        k.proto = ip->protocol;
+        memcpy(k.src, &ip->saddr, 4);
+        memcpy(k.dst, &ip->daddr, 4);
+        l4 = p + ip->ihl * 4;
+    } else if (eth->h_proto == htons(ETH_P_IPV6) &&
+        len >= ETH_HLEN + sizeof(struct ipv6hdr)) {
+        struct ipv6hdr *ip6 = (struct ipv6hdr*)p;
+        k.proto = ip6->nexthdr;
+        memcpy(k.src, &ip6->saddr, 16);
+        memcpy(k.dst, &ip6->daddr, 16);
+        l4 = p + sizeof(*ip6);
+    } else {
+        return;
+    }
+
+    s->ip[k.proto]++;
+    s->ip_bytes[k.proto] += size;
+    if ((k.proto == IPPROTO_TCP || k.proto == IPPROTO_UDP) &&
+        l4 + 4 <= rec + REC_HLEN + len) {
+        k.sport = ntohs(((uint16_t*)l4)[0]);
+        k.dport = ntohs(((uint16_t*)l4)[1]);
+    }
+    f = flow_get(s, &k, rec);
+    f->pkts++;
+    f->bytes += size;
+}
+
+void*
+stat_run(void *arg) {
+    struct stat_t *s = arg;
+    uint32_t *r;
+    size_t off;
+
+    for (off = s->off; s->end - off >= REC_HLEN; off += REC_HLEN + r[2]) {
+        r = (uint32_t*)(file.p + off);
+        if (r[2] > s->end - off - REC_HLEN)
+            break;
+        rec_decode(s, file.p + off);
+    }
+    return NULL;
+}
+
+void
+stat_merge(struct stat_t *d, struct stat_t *s) {
+    struct flow_t *f;
+    size_t j;
+    int i;
+
+    d->pkts += s->pkts;
+    d->bytes += s->bytes;
+    for (i = 0; i < LEN(d->eth); i++) d->eth[i] += s->eth[i];
+    for (i = 0; i < LEN(d->ip); i++) d->ip[i] += s->ip[i];
+    for (i = 0; i < LEN(d->ip); i++) d->ip_bytes[i] += s->ip_bytes[i];
+    for (i = 0; i < LEN(d->size); i++) d->size[i] += s->size[i];
+    for (j = 0; j < s->cap; j++) {
+        if (!s->flow[j].first)
+            continue;
+        f = flow_get(d, &s->flow[j].k, s->flow[j].first);
+        f->pkts += s->flow[j].pkts;
+        f->bytes += s->flow[j].bytes;
+    }
+}
+
+int
+flow_cmp(const void *a, const void *b) {
+    const struct flow_t *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void
+stat_print(struct stat_t *s, int top) {
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    struct flow_t *f;
+    size_t j, n = 0;
+    int i;
+
+    for (i = 0; i < LEN(s->eth); i++)
+        if (s->eth[i])
+            LOG("eth %6s %12lu\n", eth_proto_name(htons(i)), s->eth[i]);
+    for (i = 0; i < LEN(s->ip); i++)
+        if (s->ip[i])
+            LOG("ip  %6s %12lu %14lu bytes\n", ip_proto_name(i), s->ip[i],
+                s->ip_bytes[i]);
+    for (i = 0; i < LEN(s->size); i++)
+        if (s->size[i])
+            LOG("size %6lu-%-6lu %12lu\n", i ? 1UL << i : 0UL,
+                (1UL << i << 1) - 1, s->size[i]);
+
+    // compact the table and rank by bytes
+    for (j = 0; j < s->cap; j++)
+        if (s->flow[j].first)
+            s->flow[n++] = s->flow[j];
+    qsort(s->flow, n, sizeof(*s->flow), flow_cmp);
+    LOG("flows %lu\n", n);
+    for (j = 0; j < n && (int)j < top; j++) {
+        f = &s->flow[j];
+        eth_ip_addr(src, dst, (struct ethhdr*)(f->first + REC_HLEN));
+        LOG("%5s %21s:%-5u > %21s:%-5u %10lu %14lu\n",
+            ip_proto_name(f->k.proto), src, f->k.sport, dst, f->k.dport,
+            f->pkts, f->bytes);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    int fd = -1, ret = 0, threads = sysconf(_SC_NPROCESSORS_ONLN),
+        top = 10, o, i;
+    struct stat_t *s = NULL;
+    struct stat st;
+    long start;
+
+    while ((o = getopt(argc, argv, "j:n:h")) != -1) {
+        switch (o) {
+        case 'j': threads = atoi(optarg); break;
+        case 'n': top = atoi(optarg); break;
+        default: optind = argc + 1;
+        }
+    }
+    if (argc - optind != 1 || threads < 1 || threads > NTHREAD) {
+        LOG("usage: %s [-j threads] [-n top] <file.pcap>\n", argv[0]);
+        return EINVAL;
+    }
+
+    file.p = MAP_FAILED;
+    TRY((fd = open(argv[optind], O_RDONLY)) != -1, RETURN(errno, err));
+    TRY(!fstat(fd, &st), RETURN(errno, err));
+    file.size = st.st_size;
+    TRY(file.size >= PCAP_HLEN + REC_HLEN, RETURN(EINVAL, err));
+    TRY((file.p = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0))
+        != MAP_FAILED, RETURN(errno, err));
+    TRY(*(uint32_t*)file.p == 0xa1b2c3d4, RETURN(EINVAL, err));
+    file.snaplen = ((uint32_t*)file.p)[4];
+    file.sec = ((uint32_t*)(file.p + PCAP_HLEN))[0];
+
+    ASSERT(s = calloc(threads, sizeof(*s)));
+    start = get_time();
+    for (i = 0; i < threads; i++)
+        s[i].off = rec_sync(PCAP_HLEN + (file.size - PCAP_HLEN) / threads * i);
+    for (i = 0; i < threads; i++) {
+        s[i].end = i + 1 < threads ? s[i + 1].off : file.size;
+        ASSERT(!pthread_create(&s[i].tid, NULL, stat_run, &s[i]));
+    }
+    for (i = 0; i < threads; i++)
+        ASSERT(!pthread_join(s[i].tid, NULL));
+    for (i = 1; i < threads; i++)
+        stat_merge(&s[0], &s[i]);
+
+    LOG("records %lu bytes %lu threads %d in %.3f ms (%.2f GB/s)\n",
+        s->pkts, s->bytes, threads, TO_MILLISECOND(get_time() - start),
+        (double)file.size / (get_time() - start));
+    stat_print(s, top);
+
+err:
+    for (i = 0; s && i < threads; i++)
+        free(s[i].flow);
+    free(s);
+    if (file.p != MAP_FAILED) munmap(file.p, file.size);
+    if (fd > 0) close(fd);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/if_packet.h>
+
+#include "bpf.h"
+#include "config.h"
+#include "../tools.h"
+
+/*
+  blast IPv4/IPv6 TCP/UDP frames out of an interface through an AF_PACKET
+  socket: capture taps on the interface (ipdump, iphdr, ...) see each frame
+  once as outgoing. L4 checksums are left zero, the frames only exist to
+  be captured
+*/
+
+#define FRAME_MAX ETH_FRAME_LEN
+#define BATCH_MAX 1024
+
+struct frame_t {
+    union {
+        struct __packed {
+            struct ethhdr eth;
+            union __packed {
+                struct iphdr ip;
+                struct ipv6hdr ip6;
+            };
+        };
+        uint8_t data[FRAME_MAX];
+    };
+} frame[BATCH_MAX];
+
+struct mmsghdr msg[BATCH_MAX];
+struct iovec iov[BATCH_MAX];
+
+enum { UDP4, TCP4, UDP6, TCP6, NPROTO };
+char *proto_name[NPROTO] = {"udp4", "tcp4", "udp6", "tcp6"};
+
+uint16_t
+ip_csum(void *p, int len) {
+    uint16_t *w = p;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *w++;
+    if (len)
+        sum += *(uint8_t*)w;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+// flow n of a built frame: source port, IPv4 id and TCP seq
+void
+frame_flow(struct frame_t *f, int proto, int flow) {
+    int v6 = proto == UDP6 || proto == TCP6, tcp = proto == TCP4 ||
+        proto == TCP6, l3 = v6 ? sizeof(f->ip6) : sizeof(f->ip);
+    struct tcphdr *th = (struct tcphdr*)(f->data + ETH_HLEN + l3);
+    struct udphdr *uh = (struct udphdr*)(f->data + ETH_HLEN + l3);
+
+    if (!v6) {
+        f->ip.id = htons(flow);
+        f->ip.check = 0;
+        f->ip.check = ip_csum(&f->ip, l3);
+    }
+    if (tcp) {
+        th->source = htons(1024 + flow);
+        th->seq = htonl(flow);
+    } else {
+        uh->source = htons(1024 + flow);
+    }
+}
+
+// frame of size bytes (ethernet header included), at least the headers
+int
+frame_build(struct frame_t *f, int proto, int size, int flow) {
+    int v6 = proto == UDP6 || proto == TCP6, tcp = proto == TCP4 ||
+        proto == TCP6, l4 = tcp ? sizeof(struct tcphdr) :
+        sizeof(struct udphdr), l3 = v6 ? sizeof(f->ip6) : sizeof(f->ip);
+    struct tcphdr *th = (struct tcphdr*)(f->data + ETH_HLEN + l3);
+    struct udphdr *uh = (struct udphdr*)(f->data + ETH_HLEN + l3);
+
+    if (size < ETH_HLEN + l3 + l4)
+        size = ETH_HLEN + l3 + l4;
+    ZEROS(f->data, size);
+
+    // locally administered
+    memcpy(f->eth.h_dest, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+    memcpy(f->eth.h_source, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+    f->eth.h_proto = htons(v6 ? ETH_P_IPV6 : ETH_P_IP);
+
+    if (v6) {
+        f->ip6.version = 6;
+        f->ip6.payload_len = htons(size - ETH_HLEN - l3);
+        f->ip6.nexthdr = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        f->ip6.hop_limit = 64;
+        // 2001:db8::1 > 2001:db8::2
+        inet_pton(AF_INET6, "2001:db8::1", &f->ip6.saddr);
+        inet_pton(AF_INET6, "2001:db8::2", &f->ip6.daddr);
+    } else {
+        f->ip.version = 4;
+        f->ip.ihl = l3 / 4;
+        f->ip.tot_len = htons(size - ETH_HLEN);
+        f->ip.ttl = 64;
+        f->ip.protocol = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        // 192.0.2.1 > 192.0.2.2
+        f->ip.saddr = htonl(0xc0000201);
+        f->ip.daddr = htonl(0xc0000202);
+    }
+
+    if (tcp) {
+        th->dest = htons(80);
+        th->doff = l4 / 4;
+        th->ack = 1;
+        th->psh = 1;
+        th->window = htons(65535);
+    } else {
+        uh->dest = htons(53);
+        uh->len = htons(size - ETH_HLEN - l3);
+    }
+    frame_flow(f, proto, flow);
+    return size;
+}
+
+int
+list_parse(char *s, int *v, int max, char **names, int nname) {
+    char *tok, *end;
+    int n = 0, i;
+
+    for (tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        for (i = 0; i < nname && strcmp(tok, names[i]); i++);
+        if (names && i < nname) {
+            v[n++] = i;
+            continue;
+        }
+        v[n] = strtol(tok, &end, 0);
+        TRYF(!names && !*end && v[n] > 0, return -1, " %s\n", tok);
+        n++;
+    }
+    return n;
+}
+
+void
+usage(char *name) {
+    LOG("usage: %s [-i iface] [-r pps] [-t seconds] [-n count] "
+        "[-s size,...] [-p udp4,tcp4,udp6,tcp6] [-f flows] [-b batch]\n",
+        name);
+}
+
+int
+main(int argc, char **argv) {
+    int sock = -1, ret = 0, nsize = 1, nproto = NPROTO, batch = 64,
+        flows = 16, size[16] = {64}, proto[NPROTO] = {UDP4, TCP4, UDP6,
+        TCP6}, first = 0, i, o, n;
+    long rate = 0, count = 0, seconds = 5, sent = 0, bytes = 0, start, t;
+    struct sockaddr_ll addr = {0};
+    char *iface = IFACE;
+
+    while ((o = getopt(argc, argv, "i:r:t:n:s:p:f:b:h")) != -1) {
+        switch (o) {
+        case 'i': iface = optarg; break;
+        case 'r': rate = atol(optarg); break;
+        case 't': seconds = atol(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 's':
+            TRY((nsize = list_parse(optarg, size, LEN(size), NULL, 0)) > 0,
+                return EINVAL);
+            break;
+        case 'p':
+            TRY((nproto = list_parse(optarg, proto, NPROTO, proto_name,
+                NPROTO)) > 0, return EINVAL);
+            break;
+        case 'f': flows = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        default: usage(argv[0]); return EINVAL;
+        }
+    }
+    TRY(batch > 0 && batch <= BATCH_MAX && flows > 0, return EINVAL);
+
+    for (i = 0; i < nsize; i++)
+        TRYF(size[i] <= FRAME_MAX, return EINVAL, " %d\n", size[i]);
+
+    // one template per batch slot covering every proto x size pair
+    for (i = 0; i < batch; i++) {
+        iov[i].iov_base = frame[i].data;
+        iov[i].iov_len = frame_build(&frame[i], proto[i % nproto],
+            size[i / nproto % nsize], i % flows);
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    bpf_init();
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    TRY((addr.sll_ifindex = if_nametoindex(iface)), RETURN(errno, err));
+    TRY((sock = socket(PF_PACKET, SOCK_RAW | SOCK_CLOEXEC,
+        htons(ETH_P_ALL))) != -1, RETURN(errno, err));
+    TRY(!bind(sock, (struct sockaddr *)&addr, sizeof(addr)),
+        RETURN(errno, err));
+
+    start = get_time();
+    while (bpf_is_running()) {
+        t = get_time() - start;
+        if (seconds && t >= seconds * SECOND)
+            break;
+        n = batch;
+        if (count && count - sent < n)
+            n = count - sent;
+        // bursts of at most ~1ms worth of frames
+        if (rate && n > rate / 1000 + 1)
+            n = rate / 1000 + 1;
+        if (!n)
+            break;
+        // resume the template rotation where the last send stopped, short
+        // sends and small bursts would otherwise only ever use msg[0..n)
+        if (n > batch - first)
+            n = batch - first;
+
+        // pace batches against the schedule of the first frame in each
+        if (rate && sent * SECOND / rate > t)
+            SLEEP(sent * SECOND / rate - t);
+        // more flows than templates, the burst is stamped with the next ones
+        if (flows > batch)
+            for (i = 0; i < n; i++)
+                frame_flow(&frame[first + i], proto[(first + i) % nproto],
+                    (sent + i) % flows);
+
+        if ((n = sendmmsg(sock, msg + first, n, 0)) == -1) {
+            TRY(errno == EINTR || errno == ENOBUFS, RETURN(errno, err));
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            bytes += iov[first + i].iov_len;
+        sent += n;
+        first = (first + n) % batch;
+    }
+
+    t = get_time() - start;
+    LOG("sent %ld bytes %ld seconds %.3f pps %.0f\n", sent, bytes,
+        TO_SECOND(t), sent / TO_SECOND(t));
+
+err:
+    if (sock > 0) close(sock);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
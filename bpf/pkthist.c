@@ -0,0 +1,101 @@
+#include "bpf.h"
+#include "config.h"
+#include "../tools.h"
+
+#define NBUCKET 64
+
+// hist[0, NBUCKET): log2(packet length)
+// hist[NBUCKET, 2 * NBUCKET): log2(inter-arrival time) per cpu
+uint64_t hist[2 * NBUCKET], prev[2 * NBUCKET];
+
+void
+hist_print(char *title, uint64_t *v) {
+    uint64_t max = 0;
+    int lo = NBUCKET, hi = -1, i, w;
+    char bar[41];
+
+    for (i = 0; i < NBUCKET; i++) {
+        if (!v[i]) continue;
+        if (i < lo) lo = i;
+        hi = i;
+        if (v[i] > max) max = v[i];
+    }
+
+    LOG("%s\n", title);
+    for (i = lo; i <= hi; i++) {
+        w = v[i] * (sizeof(bar) - 1) / max;
+        memset(bar, '*', w);
+        memset(bar + w, ' ', sizeof(bar) - 1 - w);
+        bar[sizeof(bar)-1] = 0;
+        LOG("%20lu -> %-20lu: %-10lu |%s|\n",
+            i ? 1UL << i : 0, (1UL << i << 1) - 1, v[i], bar);
+    }
+}
+
+int
+main(void) {
+    int sock = -1, hmap = -1, last = -1, prog = -1, ret = 0;
+    uint64_t d[2 * NBUCKET];
+    int i;
+
+    bpf_init();
+    TRY(!(ret = bpf_map_create(&hmap, BPF_MAP_TYPE_ARRAY, 4, 8,
+        LEN(hist))), goto err);
+    TRY(!(ret = bpf_map_create(&last, BPF_MAP_TYPE_PERCPU_ARRAY, 4, 8,
+        1)), goto err);
+
+    struct bpf_insn insns[] = {
+        bpf_mov8(bpf_r9, bpf_r1),
+
+        bpf_ld4(bpf_r6, bpf_r9, offsetof(struct __sk_buff, len)),
+        bpf_log2(bpf_r7, bpf_r6, bpf_r1),
+        bpf_st4(bpf_fp, -4, bpf_r7),
+        bpf_map_get(hmap, -4, -1),
+        bpf_mov8i(bpf_r1, 1),
+        bpf_atom_add8(bpf_r0, 0, bpf_r1),
+
+        bpf_call(ktime_get_ns),
+        bpf_mov8(bpf_r6, bpf_r0),
+        bpf_st4i(bpf_fp, -4, 0),
+        bpf_map_get(last, -4, -1),
+        bpf_ld8(bpf_r1, bpf_r0, 0),
+        bpf_st8(bpf_r0, 0, bpf_r6),
+        bpf_jne8i(bpf_r1, 0, 2),
+        bpf_return(-1),
+        bpf_sub8(bpf_r6, bpf_r1),
+        bpf_log2(bpf_r7, bpf_r6, bpf_r1),
+        bpf_add8i(bpf_r7, NBUCKET),
+        bpf_st4(bpf_fp, -4, bpf_r7),
+        bpf_map_get(hmap, -4, -1),
+        bpf_mov8i(bpf_r1, 1),
+        bpf_atom_add8(bpf_r0, 0, bpf_r1),
+        bpf_return(-1),
+    };
+
+    bpf_print(insns, LEN(insns));
+
+    TRY(!(ret = bpf_prog_load(&prog, BPF_PROG_TYPE_SOCKET_FILTER, insns,
+        LEN(insns), "MIT", 10 * MB)), goto err);
+
+    TRY(!(ret = if_attach(&sock, IFACE, prog)), goto err);
+
+    while (bpf_is_running()) {
+        SLEEP(SECOND);
+
+        for (i = 0; i < LEN(hist); i++) {
+            TRY(!(ret = bpf_map_lookup(hmap, &i, &hist[i])), goto err);
+            d[i] = hist[i] - prev[i];
+            prev[i] = hist[i];
+        }
+        hist_print("length (bytes)", d);
+        hist_print("inter-arrival (ns)", d + NBUCKET);
+    }
+
+err:
+    if (sock > 0) close(sock);
+    if (hmap > 0) close(hmap);
+    if (last > 0) close(last);
+    if (prog > 0) close(prog);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
@@ -0,0 +1,363 @@
+#include <linux/tcp.h>
+
+#include "bpf.h"
+#include "config.h"
+#include "../tools.h"
+
+/*
+  IPv4 TCP connections are keyed by the SYN direction (client -> server).
+  A summary is published when both sides sent FIN, on RST, or when
+  userspace finds the connection idle for IDLE.
+
+  The table is a plain hash, not an LRU one, so the kernel never drops a
+  connection without a summary: above HIGH entries the sweep evicts the
+  least recently seen down to LOW and publishes them as EVICT, and SYNs
+  that still find the table full are counted as untracked.
+*/
+
+#define IDLE (30 * SECOND)
+#define MAXCONN (64 * KB)
+#define HIGH (MAXCONN / 4 * 3)
+#define LOW (MAXCONN / 2)
+
+#define F_FIN 0x01
+#define F_SYN 0x02
+#define F_RST 0x04
+#define F_ACK 0x10
+
+enum { CLOSE_FIN = 1, CLOSE_RST, CLOSE_IDLE, CLOSE_EVICT };
+
+struct key_t {
+    uint32_t saddr, daddr;
+    uint16_t sport, dport;
+};
+
+struct dir_t {
+    uint64_t bytes;
+    uint32_t seq, pkts, retrans, fin;
+};
+
+struct conn_t {
+    struct key_t key;
+    uint32_t reason;
+    uint64_t syn, synack, ack, last;
+    struct dir_t d[2];
+};
+
+#define k_off(f) offsetof(struct key_t, f)
+#define c_off(f) offsetof(struct conn_t, f)
+
+// stack
+#define CONN (-(int)sizeof(struct conn_t))
+#define IPH  (CONN - 24)
+#define TCPH (IPH - 24)
+#define RKEY (TCPH - 16)
+#define NOW  (RKEY - 8)
+#define PLEN (NOW - 8)
+
+void
+conn_print(struct conn_t *c) {
+    char src[INET_ADDRSTRLEN+8], dst[INET_ADDRSTRLEN+8];
+    char *reason[] = {"", "FIN", "RST", "IDLE", "EVICT"};
+    size_t n;
+
+    inet_ntop(AF_INET, &c->key.saddr, src, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &c->key.daddr, dst, INET_ADDRSTRLEN);
+    n = strlen(src);
+    snprintf(src + n, sizeof(src) - n, ":%d", ntohs(c->key.sport));
+    n = strlen(dst);
+    snprintf(dst + n, sizeof(dst) - n, ":%d", ntohs(c->key.dport));
+
+    LOG("%5s %21s > %-21s rtt %8.3f %8.3f ms "
+        "pkts %6u %6u bytes %10lu %10lu retrans %4u %4u\n",
+        (int)c->reason < LEN(reason) ? reason[c->reason] : "?", src, dst,
+        c->synack ? TO_MILLISECOND(c->synack - c->syn) : -1,
+        c->ack ? TO_MILLISECOND(c->ack - c->synack) : -1,
+        c->d[0].pkts, c->d[1].pkts, c->d[0].bytes, c->d[1].bytes,
+        c->d[0].retrans, c->d[1].retrans);
+}
+
+struct conn_t live[MAXCONN];
+
+int
+conn_cmp(const void *a, const void *b) {
+    const struct conn_t *x = a, *y = b;
+    return x->last < y->last ? -1 : x->last > y->last;
+}
+
+void
+conn_close(int map, struct conn_t *c, int reason) {
+    c->reason = reason;
+    conn_print(c);
+    bpf_map_delete(map, &c->key);
+}
+
+void
+conn_sweep(int map) {
+    struct key_t k, n;
+    struct conn_t *c;
+    long now = get_time();
+    int r, i, nlive = 0;
+
+    for (r = bpf_map_next(map, NULL, &k); !r && nlive < MAXCONN; k = n) {
+        r = bpf_map_next(map, &k, &n);
+        c = &live[nlive];
+        if (bpf_map_lookup(map, &k, c))
+            continue;
+        if (now - (long)c->last >= IDLE)
+            conn_close(map, c, CLOSE_IDLE);
+        else
+            nlive++;
+    }
+
+    // make room before new connections find the table full
+    if (nlive <= HIGH)
+        return;
+    qsort(live, nlive, sizeof(*live), conn_cmp);
+    for (i = 0; i < nlive - LOW; i++)
+        conn_close(map, &live[i], CLOSE_EVICT);
+}
+
+int
+main(void) {
+    int sock = -1, conns = -1, queue = -1, full = -1, prog = -1, ret = 0;
+    uint64_t untracked = 0, last = 0;
+    uint32_t zero = 0;
+    struct conn_t c;
+    long t = get_time();
+
+    bpf_init();
+    TRY(!(ret = bpf_map_create(&conns, BPF_MAP_TYPE_HASH,
+        sizeof(struct key_t), sizeof(c), MAXCONN)), goto err);
+    TRY(!(ret = bpf_map_create(&full, BPF_MAP_TYPE_ARRAY, 4, 8, 1)),
+        goto err);
+    TRY(!(ret = bpf_map_create(&queue, BPF_MAP_TYPE_QUEUE, 0,
+        sizeof(c), 64 * KB)), goto err);
+
+    struct bpf_insn insns[] = {
+        bpf_mov8(bpf_r9, bpf_r1),
+        bpf_ld4(bpf_r1, bpf_r9, offsetof(struct __sk_buff, protocol)),
+        bpf_be2(bpf_r1),
+        bpf_jeq8i(bpf_r1, ETH_P_IP, 2),
+        bpf_return(-1),
+
+        bpf_skb_load(IPH, ETH_HLEN, sizeof(struct iphdr), -1),
+        bpf_ld1(bpf_r1, bpf_fp, IPH + offsetof(struct iphdr, protocol)),
+        bpf_jeq8i(bpf_r1, IPPROTO_TCP, 2),
+        bpf_return(-1),
+        bpf_ld2(bpf_r1, bpf_fp, IPH + offsetof(struct iphdr, frag_off)),
+        bpf_be2(bpf_r1),
+        bpf_and8i(bpf_r1, 0x1fff),
+        bpf_jeq8i(bpf_r1, 0, 2),
+        bpf_return(-1),
+
+        bpf_ld1(bpf_r7, bpf_fp, IPH),
+        bpf_and8i(bpf_r7, 0xf),
+        bpf_lsh8i(bpf_r7, 2),
+        bpf_mov8(bpf_r1, bpf_r9),
+        bpf_mov8(bpf_r2, bpf_r7),
+        bpf_add8i(bpf_r2, ETH_HLEN),
+        bpf_mov8(bpf_r3, bpf_fp),
+        bpf_add8i(bpf_r3, TCPH),
+        bpf_mov8i(bpf_r4, sizeof(struct tcphdr)),
+        bpf_ret_call(skb_load_bytes, 0, -1),
+
+        // payload = tot_len - ihl * 4 - doff * 4
+        bpf_ld2(bpf_r1, bpf_fp, IPH + offsetof(struct iphdr, tot_len)),
+        bpf_be2(bpf_r1),
+        bpf_sub8(bpf_r1, bpf_r7),
+        bpf_ld1(bpf_r2, bpf_fp, TCPH + 12),
+        bpf_rsh8i(bpf_r2, 4),
+        bpf_lsh8i(bpf_r2, 2),
+        bpf_sub8(bpf_r1, bpf_r2),
+        bpf_st4(bpf_fp, PLEN, bpf_r1),
+        bpf_call(ktime_get_ns),
+        bpf_st8(bpf_fp, NOW, bpf_r0),
+
+        bpf_ld4(bpf_r1, bpf_fp, IPH + offsetof(struct iphdr, saddr)),
+        bpf_st4(bpf_fp, CONN + k_off(saddr), bpf_r1),
+        bpf_st4(bpf_fp, RKEY + k_off(daddr), bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, IPH + offsetof(struct iphdr, daddr)),
+        bpf_st4(bpf_fp, CONN + k_off(daddr), bpf_r1),
+        bpf_st4(bpf_fp, RKEY + k_off(saddr), bpf_r1),
+        bpf_ld2(bpf_r1, bpf_fp, TCPH + offsetof(struct tcphdr, source)),
+        bpf_st2(bpf_fp, CONN + k_off(sport), bpf_r1),
+        bpf_st2(bpf_fp, RKEY + k_off(dport), bpf_r1),
+        bpf_ld2(bpf_r1, bpf_fp, TCPH + offsetof(struct tcphdr, dest)),
+        bpf_st2(bpf_fp, CONN + k_off(dport), bpf_r1),
+        bpf_st2(bpf_fp, RKEY + k_off(sport), bpf_r1),
+
+        // r8: 0 client -> server, 1 server -> client
+        bpf_mov8i(bpf_r8, 0),
+        bpf_imm8_map_ld(bpf_r1, conns),
+        bpf_mov8(bpf_r2, bpf_fp),
+        bpf_add8i(bpf_r2, CONN),
+        bpf_call(map_lookup_elem),
+        bpf_jne8i(bpf_r0, 0, 53),
+        bpf_mov8i(bpf_r8, 1),
+        bpf_imm8_map_ld(bpf_r1, conns),
+        bpf_mov8(bpf_r2, bpf_fp),
+        bpf_add8i(bpf_r2, RKEY),
+        bpf_call(map_lookup_elem),
+        bpf_jne8i(bpf_r0, 0, 46),
+
+        // 46 ins: new connection on SYN
+        bpf_ld1(bpf_r1, bpf_fp, TCPH + 13),
+        bpf_and8i(bpf_r1, F_SYN|F_ACK),
+        bpf_jeq8i(bpf_r1, F_SYN, 2),
+        bpf_return(-1),
+        bpf_st4i(bpf_fp, CONN + c_off(reason), 0),
+        bpf_ld8(bpf_r1, bpf_fp, NOW),
+        bpf_st8(bpf_fp, CONN + c_off(syn), bpf_r1),
+        bpf_st8i(bpf_fp, CONN + c_off(synack), 0),
+        bpf_st8i(bpf_fp, CONN + c_off(ack), 0),
+        bpf_st8(bpf_fp, CONN + c_off(last), bpf_r1),
+        bpf_st8i(bpf_fp, CONN + c_off(d[0].bytes), 0),
+        bpf_ld4(bpf_r1, bpf_fp, TCPH + offsetof(struct tcphdr, seq)),
+        bpf_be4(bpf_r1),
+        bpf_add4i(bpf_r1, 1),
+        bpf_st4(bpf_fp, CONN + c_off(d[0].seq), bpf_r1),
+        bpf_st4i(bpf_fp, CONN + c_off(d[0].pkts), 1),
+        bpf_st4i(bpf_fp, CONN + c_off(d[0].retrans), 0),
+        bpf_st4i(bpf_fp, CONN + c_off(d[0].fin), 0),
+        bpf_st8i(bpf_fp, CONN + c_off(d[1].bytes), 0),
+        bpf_st4i(bpf_fp, CONN + c_off(d[1].seq), 0),
+        bpf_st4i(bpf_fp, CONN + c_off(d[1].pkts), 0),
+        bpf_st4i(bpf_fp, CONN + c_off(d[1].retrans), 0),
+        bpf_st4i(bpf_fp, CONN + c_off(d[1].fin), 0),
+        bpf_imm8_map_ld(bpf_r1, conns),
+        bpf_mov8(bpf_r2, bpf_fp),
+        bpf_add8i(bpf_r2, CONN),
+        bpf_mov8(bpf_r3, bpf_fp),
+        bpf_add8i(bpf_r3, CONN),
+        bpf_mov8i(bpf_r4, BPF_NOEXIST),
+        bpf_call(map_update_elem),
+        bpf_jne8i(bpf_r0, -E2BIG, 11),
+        bpf_st4i(bpf_fp, PLEN, 0),
+        bpf_map_get(full, PLEN, -1), // 8 ins
+        bpf_mov8i(bpf_r1, 1),
+        bpf_atom_add8(bpf_r0, 0, bpf_r1),
+        bpf_return(-1),
+
+        // r6: connection, r7: direction, r2: flags
+        bpf_mov8(bpf_r6, bpf_r0),
+        bpf_mov8(bpf_r7, bpf_r8),
+        bpf_mul8i(bpf_r7, sizeof(struct dir_t)),
+        bpf_add8(bpf_r7, bpf_r6),
+        bpf_ld8(bpf_r1, bpf_fp, NOW),
+        bpf_st8(bpf_r6, c_off(last), bpf_r1),
+        bpf_mov8i(bpf_r1, 1),
+        bpf_atom_add4(bpf_r7, c_off(d[0].pkts), bpf_r1),
+        bpf_ld4(bpf_r1, bpf_fp, PLEN),
+        bpf_atom_add8(bpf_r7, c_off(d[0].bytes), bpf_r1),
+        bpf_ld1(bpf_r2, bpf_fp, TCPH + 13),
+
+        // 5 ins: retransmitted SYN
+        bpf_mov8(bpf_r1, bpf_r2),
+        bpf_and8i(bpf_r1, F_SYN|F_ACK),
+        bpf_jne8i(bpf_r1, F_SYN, 2),
+        bpf_mov8i(bpf_r3, 1),
+        bpf_atom_add4(bpf_r6, c_off(d[0].retrans), bpf_r3),
+
+        // 15 ins: SYN/ACK, only as the server's reply
+        bpf_jeq8i(bpf_r8, 0, 14),
+        bpf_mov8(bpf_r1, bpf_r2),
+        bpf_and8i(bpf_r1, F_SYN|F_ACK),
+        bpf_jne8i(bpf_r1, F_SYN|F_ACK, 11),
+        bpf_ld8(bpf_r3, bpf_r6, c_off(synack)),
+        bpf_jeq8i(bpf_r3, 0, 3),
+        bpf_mov8i(bpf_r3, 1),
+        bpf_atom_add4(bpf_r6, c_off(d[1].retrans), bpf_r3),
+        bpf_ja(6),
+        bpf_ld8(bpf_r3, bpf_fp, NOW),
+        bpf_st8(bpf_r6, c_off(synack), bpf_r3),
+        bpf_ld4(bpf_r3, bpf_fp, TCPH + offsetof(struct tcphdr, seq)),
+        bpf_be4(bpf_r3),
+        bpf_add4i(bpf_r3, 1),
+        bpf_st4(bpf_r6, c_off(d[1].seq), bpf_r3),
+
+        // 10 ins: first ACK from the client completes the handshake
+        bpf_jne8i(bpf_r8, 0, 9),
+        bpf_mov8(bpf_r1, bpf_r2),
+        bpf_and8i(bpf_r1, F_SYN|F_ACK),
+        bpf_jne8i(bpf_r1, F_ACK, 6),
+        bpf_ld8(bpf_r3, bpf_r6, c_off(synack)),
+        bpf_jeq8i(bpf_r3, 0, 4),
+        bpf_ld8(bpf_r3, bpf_r6, c_off(ack)),
+        bpf_jne8i(bpf_r3, 0, 2),
+        bpf_ld8(bpf_r3, bpf_fp, NOW),
+        bpf_st8(bpf_r6, c_off(ack), bpf_r3),
+
+        // 14 ins: data not beyond the highest seen sequence is a retransmit
+        bpf_ld4(bpf_r1, bpf_fp, PLEN),
+        bpf_jeq8i(bpf_r1, 0, 12),
+        bpf_ld4(bpf_r3, bpf_fp, TCPH + offsetof(struct tcphdr, seq)),
+        bpf_be4(bpf_r3),
+        bpf_add4(bpf_r3, bpf_r1),
+        bpf_ld4(bpf_r4, bpf_r7, c_off(d[0].seq)),
+        bpf_jeq8i(bpf_r4, 0, 6),
+        bpf_mov8(bpf_r5, bpf_r3),
+        bpf_sub4(bpf_r5, bpf_r4),
+        bpf_jsgt4i(bpf_r5, 0, 3),
+        bpf_mov8i(bpf_r5, 1),
+        bpf_atom_add4(bpf_r7, c_off(d[0].retrans), bpf_r5),
+        bpf_ja(1),
+        bpf_st4(bpf_r7, c_off(d[0].seq), bpf_r3),
+
+        // close on RST or once both sides sent FIN
+        bpf_mov8i(bpf_r5, CLOSE_RST),
+        bpf_jset8i(bpf_r2, F_RST, 11),
+        bpf_jset8i(bpf_r2, F_FIN, 2),
+        bpf_return(-1),
+        bpf_st4i(bpf_r7, c_off(d[0].fin), 1),
+        bpf_ld4(bpf_r3, bpf_r6, c_off(d[0].fin)),
+        bpf_ld4(bpf_r4, bpf_r6, c_off(d[1].fin)),
+        bpf_and8(bpf_r3, bpf_r4),
+        bpf_mov8i(bpf_r5, CLOSE_FIN),
+        bpf_jne8i(bpf_r3, 0, 2),
+        bpf_return(-1),
+        bpf_st4(bpf_r6, c_off(reason), bpf_r5),
+        bpf_imm8_map_ld(bpf_r1, queue),
+        bpf_mov8(bpf_r2, bpf_r6),
+        bpf_mov8i(bpf_r3, BPF_ANY),
+        bpf_call(map_push_elem),
+        bpf_imm8_map_ld(bpf_r1, conns),
+        bpf_mov8(bpf_r2, bpf_r6),
+        bpf_call(map_delete_elem),
+        bpf_return(-1),
+    };
+
+    bpf_print(insns, LEN(insns));
+
+    TRY(!(ret = bpf_prog_load(&prog, BPF_PROG_TYPE_SOCKET_FILTER, insns,
+        LEN(insns), "MIT", 10 * MB)), goto err);
+
+    TRY(!(ret = if_attach(&sock, IFACE, prog)), goto err);
+
+    while (bpf_is_running()) {
+        TINYSLEEP();
+
+        while (!(ret = bpf_map_pop(queue, &c)))
+            conn_print(&c);
+        TRY(ret == ENOENT, goto err);
+        ret = 0;
+
+        if (get_time() - t > SECOND) {
+            conn_sweep(conns);
+            TRY(!(ret = bpf_map_lookup(full, &zero, &untracked)), goto err);
+            if (untracked != last)
+                LOG("untracked %lu connections, table full\n", untracked);
+            last = untracked;
+            t = get_time();
+        }
+    }
+
+err:
+    if (sock > 0) close(sock);
+    if (conns > 0) close(conns);
+    if (queue > 0) close(queue);
+    if (full > 0) close(full);
+    if (prog > 0) close(prog);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
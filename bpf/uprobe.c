@@ -0,0 +1,134 @@
+#include <asm/ptrace.h>
+
+#include "bpf.h"
+#include "../tools.h"
+#include "../elf-sym.h"
+
+#ifndef __x86_64__
+#error "pt_regs offsets are x86_64 only"
+#endif
+
+/*
+  func(char *p, size_t n): count hits per process and stream the first
+  CAPTURE bytes of p
+*/
+
+#define CAPTURE 64
+
+struct rec_t {
+    uint64_t ts;
+    uint32_t pid, size;
+    uint8_t data[CAPTURE];
+};
+
+#define r_off(f) offsetof(struct rec_t, f)
+
+// stack
+#define REC (-(int)sizeof(struct rec_t))
+#define KEY (REC - 8)
+#define CNT (KEY - 8)
+
+void
+hits_print(int map) {
+    uint32_t k, n;
+    uint64_t v;
+    int r;
+
+    for (r = bpf_map_next(map, NULL, &k); !r; k = n) {
+        r = bpf_map_next(map, &k, &n);
+        if (!bpf_map_lookup(map, &k, &v))
+            LOG("pid %6u hits %lu\n", k, v);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    int probe = -1, hits = -1, queue = -1, prog = -1, ret = 0;
+    uint64_t offset;
+    struct rec_t rec;
+    char *end;
+
+    if (argc != 3) {
+        LOG("usage: %s <binary> <offset|symbol>\n", argv[0]);
+        return EINVAL;
+    }
+    offset = strtoull(argv[2], &end, 0);
+    if (*end)
+        TRY(!(ret = elf_sym_offset(argv[1], argv[2], &offset)), return ret);
+
+    bpf_init();
+    TRY(!(ret = bpf_map_create(&hits, BPF_MAP_TYPE_HASH, 4, 8,
+        64 * KB)), goto err);
+    TRY(!(ret = bpf_map_create(&queue, BPF_MAP_TYPE_QUEUE, 0,
+        sizeof(rec), MB)), goto err);
+
+    struct bpf_insn insns[] = {
+        bpf_mov8(bpf_r9, bpf_r1),
+        bpf_stack_zero8(sizeof(rec) / 8),
+
+        bpf_call(get_current_pid_tgid),
+        bpf_rsh8i(bpf_r0, 32),
+        bpf_mov8(bpf_r6, bpf_r0),
+        bpf_st4(bpf_fp, KEY, bpf_r6),
+
+        bpf_imm8_map_ld(bpf_r1, hits),
+        bpf_mov8(bpf_r2, bpf_fp),
+        bpf_add8i(bpf_r2, KEY),
+        bpf_call(map_lookup_elem),
+        bpf_jeq8i(bpf_r0, 0, 3),
+        bpf_mov8i(bpf_r1, 1),
+        bpf_atom_add8(bpf_r0, 0, bpf_r1),
+        bpf_ja(9),
+        // 9 ins: first hit of this process
+        bpf_st8i(bpf_fp, CNT, 1),
+        bpf_imm8_map_ld(bpf_r1, hits),
+        bpf_mov8(bpf_r2, bpf_fp),
+        bpf_add8i(bpf_r2, KEY),
+        bpf_mov8(bpf_r3, bpf_fp),
+        bpf_add8i(bpf_r3, CNT),
+        bpf_mov8i(bpf_r4, BPF_NOEXIST),
+        bpf_call(map_update_elem),
+
+        bpf_call(ktime_get_ns),
+        bpf_st8(bpf_fp, REC + r_off(ts), bpf_r0),
+        bpf_st4(bpf_fp, REC + r_off(pid), bpf_r6),
+        bpf_ld8(bpf_r7, bpf_r9, offsetof(struct pt_regs, rsi)),
+        bpf_jle8i(bpf_r7, CAPTURE, 1),
+        bpf_mov8i(bpf_r7, CAPTURE),
+        bpf_st4(bpf_fp, REC + r_off(size), bpf_r7),
+        bpf_mov8(bpf_r1, bpf_fp),
+        bpf_add8i(bpf_r1, REC + r_off(data)),
+        bpf_mov8(bpf_r2, bpf_r7),
+        bpf_ld8(bpf_r3, bpf_r9, offsetof(struct pt_regs, rdi)),
+        bpf_call(probe_read_user),
+        bpf_map_push(queue, REC, 0),
+        bpf_return(0),
+    };
+
+    bpf_print(insns, LEN(insns));
+
+    TRY(!(ret = bpf_prog_load(&prog, BPF_PROG_TYPE_KPROBE, insns,
+        LEN(insns), "GPL", 10 * MB)), goto err);
+
+    TRY(!(ret = uprobe_attach(&probe, argv[1], offset, 0, prog)), goto err);
+    LOG("probe %s %lx\n", argv[1], offset);
+
+    while (bpf_is_running()) {
+        TINYSLEEP();
+
+        while (!(ret = bpf_map_pop(queue, &rec)))
+            LOG("%lu %6u [%u] %.*s\n", rec.ts, rec.pid, rec.size,
+                (int)rec.size, rec.data);
+        TRY(ret == ENOENT, goto err);
+        ret = 0;
+    }
+    hits_print(hits);
+
+err:
+    if (probe > 0) close(probe);
+    if (hits > 0) close(hits);
+    if (queue > 0) close(queue);
+    if (prog > 0) close(prog);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
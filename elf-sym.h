@@ -0,0 +1,92 @@
+#ifndef __ELF_SYM_H__
+#define __ELF_SYM_H__
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "./tools.h"
+
+#define _ELF_IN(size, off, len) ((uint64_t)(off) <= (uint64_t)(size) && \
+    (uint64_t)(len) <= (uint64_t)(size) - (uint64_t)(off))
+
+// value of a function symbol from .symtab or .dynsym
+static inline int
+elf_sym_value(uint8_t *p, size_t size, char *name, uint64_t *v) {
+    Elf64_Ehdr *eh = (Elf64_Ehdr*)p;
+    Elf64_Shdr *sh, *str;
+    Elf64_Sym *sym;
+    size_t i, j;
+
+    TRY(_ELF_IN(size, eh->e_shoff, eh->e_shnum * sizeof(*sh)),
+        return ENOEXEC);
+    sh = (Elf64_Shdr*)(p + eh->e_shoff);
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM)
+            continue;
+        if (sh[i].sh_link >= eh->e_shnum)
+            continue;
+        str = &sh[sh[i].sh_link];
+        if (!_ELF_IN(size, sh[i].sh_offset, sh[i].sh_size) ||
+            !_ELF_IN(size, str->sh_offset, str->sh_size))
+            continue;
+        sym = (Elf64_Sym*)(p + sh[i].sh_offset);
+        for (j = 0; j < sh[i].sh_size / sizeof(*sym); j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC ||
+                sym[j].st_shndx == SHN_UNDEF || !sym[j].st_value ||
+                sym[j].st_name >= str->sh_size)
+                continue;
+            if (strncmp((char*)p + str->sh_offset + sym[j].st_name, name,
+                str->sh_size - sym[j].st_name))
+                continue;
+            *v = sym[j].st_value;
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+// file offset of a function for uprobes: the symbol value relative to
+// the PT_LOAD segment containing it, which also covers PIE
+static inline int
+elf_sym_offset(char *path, char *name, uint64_t *off) {
+    Elf64_Ehdr *eh;
+    Elf64_Phdr *ph;
+    struct stat st;
+    uint8_t *p = MAP_FAILED;
+    uint64_t v;
+    int fd, ret = 0, i;
+
+    TRY((fd = open(path, O_RDONLY)) != -1, return errno);
+    TRY(!fstat(fd, &st), RETURN(errno, err));
+    TRY((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+        != MAP_FAILED, RETURN(errno, err));
+
+    eh = (Elf64_Ehdr*)p;
+    TRY((size_t)st.st_size >= sizeof(*eh) &&
+        !memcmp(eh->e_ident, ELFMAG, SELFMAG) &&
+        eh->e_ident[EI_CLASS] == ELFCLASS64, RETURN(ENOEXEC, err));
+    TRYF(!(ret = elf_sym_value(p, st.st_size, name, &v)), goto err,
+        " %s: %s\n", path, name);
+
+    TRY(_ELF_IN(st.st_size, eh->e_phoff, eh->e_phnum * sizeof(*ph)),
+        RETURN(ENOEXEC, err));
+    ph = (Elf64_Phdr*)(p + eh->e_phoff);
+    ret = ENOENT;
+    for (i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || v < ph[i].p_vaddr ||
+            v >= ph[i].p_vaddr + ph[i].p_memsz)
+            continue;
+        *off = v - ph[i].p_vaddr + ph[i].p_offset;
+        ret = 0;
+        break;
+    }
+
+err:
+    if (p != MAP_FAILED) munmap(p, st.st_size);
+    close(fd);
+    return ret;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include <pthread.h>
+
+#include "../tools.h"
+
+// probe target, same signature as func in test.c
+__attribute__((noinline)) int
+bench_func(char *p, size_t n) {
+    __asm__ volatile("" ::: "memory");
+    return n ? p[0] : 0;
+}
+
+void*
+bench_worker(void *arg) {
+    long i, n = *(long*)arg;
+    char buf[] = "bench";
+
+    for (i = 0; i < n; i++)
+        bench_func(buf, sizeof(buf) - 1);
+    return NULL;
+}
+
+// ns per call seen by each thread
+double
+bench_run(int threads, long calls) {
+    pthread_t t[threads];
+    long start = get_time();
+    int i;
+
+    for (i = 0; i < threads; i++)
+        ASSERT(!pthread_create(&t[i], NULL, bench_worker, &calls));
+    for (i = 0; i < threads; i++)
+        ASSERT(!pthread_join(t[i], NULL));
+    return (double)(get_time() - start) / calls;
+}
+
+int
+main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    long calls = argc > 2 ? atol(argv[2]) : 1000000;
+    double ns;
+    int t;
+
+    bench_run(1, calls / 10);
+    LOG("%8s %12s %10s %10s\n", "threads", "calls", "ns/call", "Mcalls/s");
+    for (t = 1; t <= threads; t = t < threads && t * 2 > threads ?
+        threads : t * 2) {
+        ns = bench_run(t, calls);
+        LOG("%8d %12ld %10.1f %10.2f\n", t, calls * t, ns, t * 1e3 / ns);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+
+# ns/call of bench_func with no probe, with an empty handler (only the
+# per-cpu hit counter: tracing=0 latency=0) and with ring tracing drained
+# by reader plus latency histograms
+# usage: ./bench.sh [threads] [calls]
+
+set -e
+
+THREADS=${1:-$(nproc)}
+CALLS=${2:-1000000}
+PROBES=$(./resolve ./bench:bench_func)
+
+./bench $THREADS $CALLS > none.txt
+
+insmod uprobe.ko $PROBES tracing=0 latency=0
+./bench $THREADS $CALLS > empty.txt
+rmmod uprobe
+
+insmod uprobe.ko $PROBES
+./reader > /dev/null &
+READER=$!
+./bench $THREADS $CALLS > full.txt
+kill -INT $READER
+wait $READER || true
+rmmod uprobe
+
+paste none.txt empty.txt full.txt | awk '
+NR == 1 {
+    printf "%8s %10s %10s %10s %10s %10s\n", "threads", "none",
+        "empty", "full", "+empty", "+full"
+}
+NR > 1 {
+    printf "%8d %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        $1, $3, $7, $11, $7 - $3, $11 - $3
+}'
+rm -f none.txt empty.txt full.txt
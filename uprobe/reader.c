@@ -0,0 +1,85 @@
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+#include "../tools.h"
+
+volatile int running = 1;
+
+void
+sigint_handler(int sig __unused) {
+    running = 0;
+}
+
+void
+rec_print(struct trace_rec *r) {
+    LOG("%lu %2u %6u %3u [%u] %.*s\n", (unsigned long)r->ts, r->probe,
+        r->pid, r->cpu, r->size, (int)r->size, (char*)(r + 1));
+}
+
+size_t
+ring_drain(struct trace_ring *r) {
+    uint8_t *p = (uint8_t*)r + TRACE_PAGE;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    struct trace_rec *rec;
+    size_t n = 0;
+
+    for (; tail != head; tail += rec->len) {
+        rec = (struct trace_rec*)(p + (tail & (r->size - 1)));
+        if (rec->probe == TRACE_PAD) continue;
+        rec_print(rec);
+        n++;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+int
+main(void) {
+    struct sigaction sa = {.sa_handler = sigint_handler};
+    struct pollfd pfd = {.events = POLLIN};
+    struct trace_ring *r;
+    uint8_t *area = MAP_FAILED;
+    size_t size = 0, n = 0, lost = 0, i, ncpu;
+    int ret = 0;
+
+    sigemptyset(&sa.sa_mask);
+    ASSERT(!sigaction(SIGINT, &sa, NULL));
+
+    TRY((pfd.fd = open("/dev/" TRACE_DEV, O_RDWR)) != -1,
+        RETURN(errno, err));
+
+    TRY((r = mmap(NULL, TRACE_PAGE, PROT_READ, MAP_SHARED, pfd.fd, 0))
+        != MAP_FAILED, RETURN(errno, err));
+    ncpu = r->ncpu;
+    size = ncpu * (TRACE_PAGE + r->size);
+    munmap(r, TRACE_PAGE);
+
+    TRY((area = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+        pfd.fd, 0)) != MAP_FAILED, RETURN(errno, err));
+
+    while (running) {
+        if (poll(&pfd, 1, 100) == -1) {
+            TRY(errno == EINTR, RETURN(errno, err));
+            continue;
+        }
+        for (i = 0; i < ncpu; i++) {
+            r = (struct trace_ring*)(area + i * size / ncpu);
+            n += ring_drain(r);
+        }
+        fflush(stdout);
+    }
+
+    for (i = 0; i < ncpu; i++)
+        lost += ((struct trace_ring*)(area + i * size / ncpu))->lost;
+    LOG("records %lu lost %lu\n", n, lost);
+
+err:
+    if (area != MAP_FAILED) munmap(area, size);
+    if (pfd.fd > 0) close(pfd.fd);
+    if (ret) LOGERR("%s\n", strerror(ret));
+    return ret;
+}
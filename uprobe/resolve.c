@@ -0,0 +1,32 @@
+#include "../elf-sym.h"
+
+/*
+  binary:symbol[:capture] ... -> probes=binary:offset[:capture],...
+  insmod uprobe.ko $(./resolve /bin/foo:bar /bin/foo:baz:64)
+*/
+
+int
+main(int argc, char **argv) {
+    char *path, *sym, *cap;
+    uint64_t off;
+    int i, ret = 0;
+
+    if (argc < 2) {
+        LOG("usage: %s binary:symbol[:capture] ...\n", argv[0]);
+        return EINVAL;
+    }
+
+    LOG("probes=");
+    for (i = 1; i < argc; i++) {
+        path = argv[i];
+        TRYF(sym = strchr(path, ':'), return EINVAL, " %s\n", argv[i]);
+        *sym++ = 0;
+        if ((cap = strchr(sym, ':')))
+            *cap++ = 0;
+        TRY(!(ret = elf_sym_offset(path, sym, &off)), return ret);
+        LOG("%s%s:0x%lx", i > 1 ? "," : "", path, off);
+        if (cap) LOG(":%s", cap);
+    }
+    LOG("\n");
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <linux/types.h>
+
+/*
+  /dev/uprobe maps one ring per possible cpu:
+    [trace_ring, TRACE_PAGE bytes][data, size bytes] ...
+  head is only written by the module, tail only by the reader. Both are
+  free running byte counters, records are TRACE_ALIGN aligned and never
+  wrap, a record with probe == TRACE_PAD pads to the end of the ring.
+  size can be 0 for real hits (nothing captured or the copy failed).
+*/
+
+#define TRACE_DEV     "uprobe"
+#define TRACE_PAGE    4096
+#define TRACE_ALIGN   32
+#define TRACE_CAPTURE 256
+#define TRACE_PAD     (~0U)
+
+struct trace_ring {
+    __u64 head, tail, lost;
+    __u32 ncpu, size;
+};
+
+struct trace_rec {
+    __u64 ts;
+    __u32 pid, cpu;
+    __u32 size, len;
+    __u32 probe, pad;
+};
+
+#endif
@@ -1,61 +1,427 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
 #include <linux/namei.h>
 #include <linux/ctype.h>
 #include <linux/uprobes.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
 
 #include "../module.h"
+#include "trace.h"
+
+#define NBUCKET 64
+#define NSLOT   1024
+#define NSCAN   8
+#define NSITE   64
+#define DEPTH   16
+#define NPID    256
+
+// entry timestamps of a task, only the task itself touches a claimed slot
+// until it goes stale: a task that exits or longjmps out of a probed
+// function never drops its slot, so one untouched for stale ms is reused
+struct slot {
+    pid_t pid;
+    u32 depth;
+    u64 seen;
+    u64 ts[DEPTH];
+};
+
+struct hist {
+    u64 b[NBUCKET];
+};
+
+// keyed on tgid, so all threads of a process share one histogram and
+// update it from any cpu
+struct pid_hist {
+    pid_t pid;
+    atomic64_t b[NBUCKET];
+};
+
+// probes=path:offset[:capture],...
+struct site {
+    char *spec, *path;
+    long offset;
+    int capture;
+    struct inode *inode;
+    struct uprobe_consumer uc;
+    u64 __percpu *hits;
+    struct hist __percpu *lat;
+};
 
 static char *filename;
 static long offset;
-static struct inode *inode;
-static struct uprobe_consumer uc;
-static char buf[16*KB];
+static char *probes[NSITE];
+static int nprobes;
+static ulong ring = MB;
+static int capture = TRACE_CAPTURE;
+static ulong stale = 10000;
+static bool tracing = 1, latency = 1, per_pid;
+static struct site sites[NSITE];
+static int nsite;
+static void *area;
+static DECLARE_WAIT_QUEUE_HEAD(wait);
+static struct slot slots[NSLOT];
+static struct pid_hist pids[NPID];
+static atomic64_t missed;
+static struct dentry *dir;
 
 module_param(filename, charp, S_IRUGO);
 module_param(offset, long, S_IRUGO);
+module_param_array(probes, charp, &nprobes, S_IRUGO);
+module_param(ring, ulong, S_IRUGO);
+module_param(capture, int, S_IRUGO);
+module_param(tracing, bool, S_IRUGO);
+module_param(latency, bool, S_IRUGO);
+module_param(per_pid, bool, S_IRUGO);
+module_param(stale, ulong, S_IRUGO);
+
+static struct trace_ring *ring_get(int cpu) {
+    return area + (size_t)cpu * (TRACE_PAGE + ring);
+}
+
+// the reader is woken once a ring is 1/8 full, it polls with a timeout
+static void trace(u32 site, void *data, u32 size) {
+    struct trace_ring *r;
+    struct trace_rec *rec;
+    u8 *p;
+    u64 head, tail, pos, len, pad;
+    int wake = 0;
+
+    r = ring_get(get_cpu());
+    p = (u8*)r + TRACE_PAGE;
+    head = r->head;
+    tail = smp_load_acquire(&r->tail);
+    pos = head & (ring - 1);
+    len = ALIGN(sizeof(*rec) + size, TRACE_ALIGN);
+    pad = ring - pos < len ? ring - pos : 0;
+    if (head + pad + len - tail > ring) {
+        r->lost++;
+        goto out;
+    }
+
+    if (pad) {
+        rec = (struct trace_rec*)(p + pos);
+        rec->size = 0;
+        rec->len = pad;
+        rec->probe = TRACE_PAD;
+        head += pad;
+        pos = 0;
+    }
+
+    rec = (struct trace_rec*)(p + pos);
+    rec->ts = ktime_get_ns();
+    rec->pid = current->pid;
+    rec->cpu = smp_processor_id();
+    rec->size = size;
+    rec->len = len;
+    rec->probe = site;
+    memcpy(rec + 1, data, size);
+    smp_store_release(&r->head, head + len);
+    wake = head + len - tail >= ring / 8;
+out:
+    put_cpu();
+    if (wake && wq_has_sleeper(&wait))
+        wake_up_interruptible(&wait);
+}
+
+static int trace_mmap(struct file *f, struct vm_area_struct *vma) {
+    return remap_vmalloc_range(vma, area, vma->vm_pgoff);
+}
+
+static __poll_t trace_poll(struct file *f, poll_table *pt) {
+    struct trace_ring *r;
+    int cpu;
+
+    poll_wait(f, &wait, pt);
+    for_each_possible_cpu(cpu) {
+        r = ring_get(cpu);
+        if (smp_load_acquire(&r->head) != READ_ONCE(r->tail))
+            return EPOLLIN | EPOLLRDNORM;
+    }
+    return 0;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .mmap = trace_mmap,
+    .poll = trace_poll,
+};
+
+static struct miscdevice trace_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = TRACE_DEV,
+    .fops = &trace_fops,
+};
+
+static int slot_stale(struct slot *s, u64 now) {
+    return now - READ_ONCE(s->seen) > stale * NSEC_PER_MSEC;
+}
+
+static struct slot *slot_get(pid_t pid, int claim, u64 now) {
+    struct slot *s;
+    pid_t old;
+    u32 h = hash_32(pid, ilog2(NSLOT)), i;
+
+    for (i = 0; i < NSCAN; i++) {
+        s = &slots[(h + i) & (NSLOT - 1)];
+        old = READ_ONCE(s->pid);
+        if (old == pid)
+            return s;
+        if (!claim)
+            continue;
+        if (!old && !cmpxchg(&s->pid, 0, pid))
+            return s;
+        if (old && slot_stale(s, now) && cmpxchg(&s->pid, old, pid) == old) {
+            s->depth = 0;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static struct pid_hist *pid_hist_get(pid_t pid) {
+    struct pid_hist *p;
+    u32 h = hash_32(pid, ilog2(NPID)), i;
+
+    for (i = 0; i < NPID; i++) {
+        p = &pids[(h + i) & (NPID - 1)];
+        if (READ_ONCE(p->pid) == pid)
+            return p;
+        if (!READ_ONCE(p->pid) && !cmpxchg(&p->pid, 0, pid))
+            return p;
+    }
+    return NULL;
+}
+
+static void latency_enter(void) {
+    struct slot *s;
+    pid_t pid = current->pid;
+    u64 now = ktime_get_ns();
+
+    if (!(s = slot_get(pid, 0, now)) && !(s = slot_get(pid, 1, now))) {
+        atomic64_inc(&missed);
+        return;
+    }
+    // entries whose returns were never seen
+    if (s->depth && slot_stale(s, now))
+        s->depth = 0;
+    WRITE_ONCE(s->seen, now);
+    if (s->depth < DEPTH)
+        s->ts[s->depth] = now;
+    s->depth++;
+}
+
+static void latency_exit(struct site *site) {
+    struct slot *s;
+    struct pid_hist *p;
+    u64 now = ktime_get_ns(), d;
+    int b;
+
+    if (!(s = slot_get(current->pid, 0, now)) || !s->depth)
+        return;
+    WRITE_ONCE(s->seen, now);
+    s->depth--;
+    if (s->depth < DEPTH) {
+        d = now - s->ts[s->depth];
+        b = d ? ilog2(d) : 0;
+        this_cpu_inc(site->lat->b[b]);
+        if (per_pid && (p = pid_hist_get(current->tgid)))
+            atomic64_inc(&p->b[b]);
+    }
+    if (!s->depth)
+        smp_store_release(&s->pid, 0);
+}
+
+static void hist_show(struct seq_file *m, u64 *b) {
+    int lo, hi;
+
+    for (lo = 0; lo < NBUCKET && !b[lo]; lo++);
+    for (hi = NBUCKET - 1; hi >= lo && !b[hi]; hi--);
+    for (; lo <= hi; lo++)
+        seq_printf(m, "%20llu -> %-20llu: %llu\n",
+            lo ? 1ULL << lo : 0, (1ULL << lo << 1) - 1, b[lo]);
+}
+
+static int latency_show(struct seq_file *m, void *v) {
+    u64 b[NBUCKET];
+    int cpu, i, j;
+
+    seq_printf(m, "missed %lld\n", atomic64_read(&missed));
+    for (i = 0; i < nsite; i++) {
+        memset(b, 0, sizeof(b));
+        for_each_possible_cpu(cpu)
+            for (j = 0; j < NBUCKET; j++)
+                b[j] += per_cpu_ptr(sites[i].lat, cpu)->b[j];
+        seq_printf(m, "probe %d %s:0x%lx\n", i, sites[i].path,
+            sites[i].offset);
+        hist_show(m, b);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
 
-static void dump(uint8_t *data, size_t size) {
-    size_t p, n;
+static int hits_show(struct seq_file *m, void *v) {
+    u64 n;
+    int cpu, i;
 
-    for (p = 0; p < size; p += n) {
-        n = size - p;
-        if (n > sizeof(buf)) n = sizeof(buf);
-        TRY(!copy_from_user(buf, data + p, n), return);
-        LOG("%s\n", buf);
+    for (i = 0; i < nsite; i++) {
+        n = 0;
+        for_each_possible_cpu(cpu)
+            n += *per_cpu_ptr(sites[i].hits, cpu);
+        seq_printf(m, "%2d %16llu %s:0x%lx\n", i, n, sites[i].path,
+            sites[i].offset);
     }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hits);
+
+static int latency_pid_show(struct seq_file *m, void *v) {
+    u64 b[NBUCKET];
+    int i, j;
 
+    for (i = 0; i < NPID; i++) {
+        if (!READ_ONCE(pids[i].pid)) continue;
+        for (j = 0; j < NBUCKET; j++)
+            b[j] = atomic64_read(&pids[i].b[j]);
+        seq_printf(m, "pid %d\n", pids[i].pid);
+        hist_show(m, b);
+    }
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(latency_pid);
 
 static int handler_pre(struct uprobe_consumer *self, struct pt_regs *regs) {
-    dump((uint8_t*)regs->di, regs->si);
+    struct site *s = container_of(self, struct site, uc);
+    u8 data[TRACE_CAPTURE];
+    size_t n = min_t(size_t, regs->si, s->capture);
+
+    this_cpu_inc(*s->hits);
+    if (latency)
+        latency_enter();
+    if (!tracing)
+        return 0;
+    if (n && copy_from_user(data, (void __user*)regs->di, n))
+        n = 0;
+    trace(s - sites, data, n);
     return 0;
 }
 
 static int handler_ret(struct uprobe_consumer *self, unsigned long func,
     struct pt_regs *regs) {
+    latency_exit(container_of(self, struct site, uc));
     return 0;
 }
 
-static int __init uprobe_init(void) {
-    struct path path;
+static void site_free(struct site *s) {
+    if (s->inode) iput(s->inode);
+    free_percpu(s->hits);
+    free_percpu(s->lat);
+    kfree(s->spec);
+    memset(s, 0, sizeof(*s));
+}
+
+// spec is owned by the site
+static int site_add(char *spec, char *path, long off, int cap) {
+    struct site *s = &sites[nsite];
+    struct path p;
     int ret = 0;
 
-    TRY(filename, RETURN(EINVAL, err));
+    s->spec = spec;
+    s->path = path;
+    s->offset = off;
+    s->capture = clamp(cap, 0, TRACE_CAPTURE);
+    TRY(!(ret = kern_path(path, LOOKUP_FOLLOW, &p)), goto err);
+    s->inode = igrab(p.dentry->d_inode);
+    path_put(&p);
+    TRY(s->hits = alloc_percpu(u64), RETURN(-ENOMEM, err));
+    TRY(s->lat = alloc_percpu(struct hist), RETURN(-ENOMEM, err));
 
-    TRY(!(ret = kern_path(filename, LOOKUP_FOLLOW, &path)), goto err);
-    inode = igrab(path.dentry->d_inode);
-    path_put(&path);
+    s->uc.handler = handler_pre;
+    s->uc.ret_handler = latency ? handler_ret : NULL;
+    TRY(!(ret = uprobe_register(s->inode, off, &s->uc)), goto err);
+    LOG("probe %d %s %lx\n", nsite, path, off);
+    nsite++;
 
-    uc.handler = handler_pre,
-    uc.ret_handler = handler_ret,
-    TRY(!(ret = uprobe_register(inode, offset, &uc)), goto err);
-    LOG("probe %s %lx\n", filename, offset);
+err:
+    if (ret) site_free(s);
+    return ret;
+}
+
+static int site_parse(char *spec) {
+    char *p, *path, *tok;
+    long off;
+    int cap = capture;
 
+    TRY(p = kstrdup(spec, GFP_KERNEL), return -ENOMEM);
+    spec = p;
+    path = strsep(&p, ":");
+    TRYF((tok = strsep(&p, ":")) && !kstrtol(tok, 0, &off),
+        goto err, "%s\n", spec);
+    if ((tok = strsep(&p, ":")))
+        TRYF(!kstrtoint(tok, 0, &cap), goto err, "%s\n", spec);
+    return site_add(spec, path, off, cap);
 err:
+    kfree(spec);
+    return -EINVAL;
+}
+
+static void uprobe_free(void) {
+    struct site *s;
+
+    for (s = sites; s < sites + nsite; s++) {
+        uprobe_unregister(s->inode, s->offset, &s->uc);
+        site_free(s);
+    }
+    nsite = 0;
+    debugfs_remove_recursive(dir);
+    misc_deregister(&trace_dev);
+    vfree(area);
+}
+
+static int __init uprobe_init(void) {
+    int ret = 0, cpu, i;
+
+    TRY(filename || nprobes, return -EINVAL);
+    TRY(nprobes + !!filename <= NSITE, return -E2BIG);
+
+    ring = roundup_pow_of_two(max_t(ulong, ring, TRACE_PAGE));
+    capture = clamp(capture, 0, TRACE_CAPTURE);
+    TRY(area = vmalloc_user(nr_cpu_ids * (TRACE_PAGE + ring)),
+        return -ENOMEM);
+    for_each_possible_cpu(cpu) {
+        ring_get(cpu)->ncpu = nr_cpu_ids;
+        ring_get(cpu)->size = ring;
+    }
+    TRY(!(ret = misc_register(&trace_dev)), goto err_dev);
+
+    dir = debugfs_create_dir("uprobe", NULL);
+    debugfs_create_file("hits", 0444, dir, NULL, &hits_fops);
+    debugfs_create_file("latency", 0444, dir, NULL, &latency_fops);
+    if (per_pid)
+        debugfs_create_file("latency_pid", 0444, dir, NULL,
+            &latency_pid_fops);
+
+    if (filename)
+        TRY(!(ret = site_add(NULL, filename, offset, capture)), goto err);
+    for (i = 0; i < nprobes; i++)
+        TRY(!(ret = site_parse(probes[i])), goto err);
+    return 0;
+
+err:
+    uprobe_free();
+    return ret;
+err_dev:
+    vfree(area);
     return ret;
 }
 
 static void __exit uprobe_exit(void) {
-    uprobe_unregister(inode, offset, &uc);
+    uprobe_free();
     LOG("uprobe exit\n");
 }
 